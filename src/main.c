@@ -27,6 +27,14 @@
 
 #define ENABLE_SOUND 1
 
+#define WORKER_STACK_SIZE 16384
+#define AUDIO_RING_SLOTS 4
+#define AUDIO_RING_SLOTS_LOW_MEMORY 2
+/* Number of unchanged frames before the screen is considered static. */
+#define STATIC_SCREEN_FRAMES 60
+/* Output lines of the fit-to-height mode, i.e. LCD_HEIGHT * 2 / 3. */
+#define FIT_HEIGHT_LINES 96
+
 /* Compat with old Peanut-GB. */
 #ifndef JOYPAD_A
 #define JOYPAD_A            0x01
@@ -39,34 +47,292 @@
 #define JOYPAD_DOWN         0x80
 #endif
 
+#if WB_PROFILE
+/* Memory access counters for the profiling build (-Dprofile=true). Only accesses that go through frontend callbacks
+   are visible here. */
+#define PROFILE_ROM_BANKS 512
+#define PROFILE_CART_RAM_BANKS 16
+#define PROFILE_APU_REGS 0x30
+
+struct profile_s {
+  unsigned long long frames;
+  unsigned long long rom_read[PROFILE_ROM_BANKS];
+  unsigned long long cart_ram_read[PROFILE_CART_RAM_BANKS];
+  unsigned long long cart_ram_write[PROFILE_CART_RAM_BANKS];
+  unsigned long long apu_read[PROFILE_APU_REGS];
+  unsigned long long apu_write[PROFILE_APU_REGS];
+};
+
+struct profile_entry_s {
+  char name[24];
+  unsigned long long count;
+};
+
+static struct profile_s g_profile;
+#define PROFILE_COUNT(counter) ((counter)++)
+#else
+#define PROFILE_COUNT(counter)
+#endif
+
 #include "minigb_apu.h"
 
+/* WB_AUDIO_SAMPLE_RATE is set together with AUDIO_SAMPLE_RATE by the audio_sample_rate build option. A minigb_apu
+   that hardcodes its rate would synthesize at a different rate than the PCM codec gets opened with. */
+#if defined(WB_AUDIO_SAMPLE_RATE) && AUDIO_SAMPLE_RATE != WB_AUDIO_SAMPLE_RATE
+#error "This minigb_apu does not honor AUDIO_SAMPLE_RATE. Build with the default audio_sample_rate."
+#endif
+
 #ifndef LEGACY_APU
-struct minigb_apu_ctx g_apu_ctx;
+/* Shadow of the APU state that decides whether any channel can produce output at all. A channel is silenced (and
+   disabled) as soon as its DAC is turned off, so a frame where the APU is powered off or all DACs are off can be
+   filled with silence without running synthesis. */
+struct apu_activity_s {
+  /* Bit n set: DAC of channel n + 1 is on. */
+  uint8_t dac_on;
+  bool power;
+};
+
+/* Register file served to the core while synthesis runs on the audio worker (see AsyncAudio). */
+struct apu_shadow_s {
+  uint8_t regs[0x30];
+  /* Bit n set: channel n + 1 was triggered with its DAC on. Length counter expiry is not tracked. */
+  uint8_t chan_on;
+};
+
+#define APU_WRITE_LOG_SIZE 1024
+
+struct apu_write_s {
+  uint16_t addr;
+  uint8_t val;
+};
+
+/* APU register writes made by the core during one frame, handed from the emulator thread to the audio worker along
+   with the ring slot they will be synthesized into. */
+struct apu_write_log_s {
+  size_t count;
+  /* Whether a frame should be synthesized after replaying the log. Cleared when the log filled up mid-frame and had
+     to be handed off early. */
+  bool synthesize;
+  struct apu_write_s writes[APU_WRITE_LOG_SIZE];
+};
+
+#else
+#ifndef AUDIO_SAMPLES_TOTAL
+#define AUDIO_SAMPLES_TOTAL AUDIO_SAMPLES * 2
+#endif
+typedef int16_t audio_sample_t;
+#endif
+
+/* Audio state of one emulator instance. */
+struct priv_audio_s {
+#ifndef LEGACY_APU
+  struct minigb_apu_ctx apu;
+  struct apu_activity_s activity;
+  /* When set, apu is owned by the audio worker and the core talks to shadow instead. */
+  bool async;
+  struct apu_shadow_s shadow;
+  /* One log per ring slot plus the one currently being filled by the emulator thread. Logs are swapped, not
+     copied. */
+  struct apu_write_log_s *write_logs;
+  struct apu_write_log_s *slot_log[AUDIO_RING_SLOTS];
+  struct apu_write_log_s *pending_log;
+#endif
+  /* Number of frames where synthesis was skipped. */
+  volatile unsigned int silent_frames;
+
+  /* Ring of synthesized frames, AUDIO_SAMPLES_TOTAL samples per slot. */
+  audio_sample_t *buffer;
+  volatile uint8_t consumer_offset;
+  volatile uint8_t producer_offset;
+  uint8_t ring_mask;
+
+  volatile bool running;
+  /* The worker is parked on resume while muted. */
+  volatile bool paused;
+  thread_t *worker_inst;
+  event_t *shutdown_ack;
+  event_t *pause_ack;
+  event_t *resume;
+};
+
+#ifndef LEGACY_APU
+/* Instance that the core's audio_read() and audio_write() callbacks talk to. These callbacks have no instance
+   argument. */
+static struct priv_audio_s *audio_instance = NULL;
+
+static void _audio_init(struct priv_audio_s *audio) {
+  audio_instance = audio;
+  minigb_apu_audio_init(&audio->apu);
+  /* minigb_apu powers up with the DACs on. */
+  audio->activity.dac_on = 0xf;
+  audio->activity.power = true;
+  audio->silent_frames = 0;
+}
+
+static inline bool _apu_can_output(const struct priv_audio_s * const audio) {
+  return audio->activity.power && audio->activity.dac_on != 0;
+}
+
+static void _apu_track_write(struct priv_audio_s *audio, const uint16_t addr, const uint8_t val) {
+  struct apu_activity_s * const activity = &audio->activity;
+
+  if (addr == 0xff26) {
+    activity->power = !!(val & 0x80);
+    /* Powering off clears all APU registers. */
+    if (!activity->power) {
+      activity->dac_on = 0;
+    }
+    return;
+  }
+
+  /* Register writes are ignored while the APU is off. */
+  if (!activity->power) {
+    return;
+  }
 
-static void audio_init(void) {
-  minigb_apu_audio_init(&g_apu_ctx);
+  switch (addr) {
+  case 0xff12:
+    activity->dac_on = (val & 0xf8) ? (activity->dac_on | 0x1) : (activity->dac_on & ~0x1);
+    break;
+  case 0xff17:
+    activity->dac_on = (val & 0xf8) ? (activity->dac_on | 0x2) : (activity->dac_on & ~0x2);
+    break;
+  case 0xff1a:
+    activity->dac_on = (val & 0x80) ? (activity->dac_on | 0x4) : (activity->dac_on & ~0x4);
+    break;
+  case 0xff21:
+    activity->dac_on = (val & 0xf8) ? (activity->dac_on | 0x8) : (activity->dac_on & ~0x8);
+    break;
+  }
 }
 
-static void audio_callback_wrapper(audio_sample_t *samples) {
-  minigb_apu_audio_callback(&g_apu_ctx, samples);
+/* Bits that always read back as 1, for 0xff10-0xff3f. */
+const uint8_t APU_READ_MASK[0x30] = {
+  0x80, 0x3f, 0x00, 0xff, 0xbf,
+  0xff, 0x3f, 0x00, 0xff, 0xbf,
+  0x7f, 0xff, 0x9f, 0xff, 0xbf,
+  0xff, 0xff, 0x00, 0x00, 0xbf,
+  0x00, 0x00, 0x70,
+  0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+  0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00,
+};
+
+static void _apu_log_append(struct priv_audio_s *audio, const uint16_t addr, const uint8_t val);
+
+static void audio_callback_wrapper(struct priv_audio_s *audio, audio_sample_t *samples) {
+  minigb_apu_audio_callback(&audio->apu, samples);
+}
+
+/* Initialize the shadow register file from the current APU state. */
+static void _apu_shadow_sync(struct priv_audio_s *audio) {
+  for (uint16_t addr = 0xff10; addr < 0xff40; addr++) {
+    audio->shadow.regs[addr - 0xff10] = minigb_apu_audio_read(&audio->apu, addr);
+  }
+  audio->shadow.chan_on = audio->shadow.regs[0xff26 - 0xff10] & 0xf;
+}
+
+static uint8_t _apu_shadow_read(const struct priv_audio_s * const audio, const uint16_t addr) {
+  if (addr == 0xff26) {
+    return (audio->shadow.regs[0xff26 - 0xff10] & 0x80) | 0x70 | audio->shadow.chan_on;
+  }
+  return audio->shadow.regs[addr - 0xff10] | APU_READ_MASK[addr - 0xff10];
+}
+
+static void _apu_shadow_write(struct priv_audio_s *audio, const uint16_t addr, const uint8_t val) {
+  struct apu_shadow_s * const shadow = &audio->shadow;
+  uint8_t *regs = shadow->regs;
+
+  if (addr == 0xff26) {
+    if (!(val & 0x80)) {
+      memset(regs, 0, 0xff26 - 0xff10);
+      shadow->chan_on = 0;
+    }
+    regs[0xff26 - 0xff10] = val & 0x80;
+    return;
+  }
+
+  /* Everything except wave RAM is read-only while the APU is off. */
+  if (!(regs[0xff26 - 0xff10] & 0x80) && addr < 0xff30) {
+    return;
+  }
+
+  regs[addr - 0xff10] = val;
+
+  switch (addr) {
+  case 0xff12:
+  case 0xff17:
+  case 0xff21:
+    if (!(val & 0xf8)) {
+      shadow->chan_on &= ~(1 << ((addr == 0xff12) ? 0 : (addr == 0xff17) ? 1 : 3));
+    }
+    break;
+  case 0xff1a:
+    if (!(val & 0x80)) {
+      shadow->chan_on &= ~0x4;
+    }
+    break;
+  case 0xff14:
+    if ((val & 0x80) && (regs[0xff12 - 0xff10] & 0xf8)) {
+      shadow->chan_on |= 0x1;
+    }
+    break;
+  case 0xff19:
+    if ((val & 0x80) && (regs[0xff17 - 0xff10] & 0xf8)) {
+      shadow->chan_on |= 0x2;
+    }
+    break;
+  case 0xff1e:
+    if ((val & 0x80) && (regs[0xff1a - 0xff10] & 0x80)) {
+      shadow->chan_on |= 0x4;
+    }
+    break;
+  case 0xff23:
+    if ((val & 0x80) && (regs[0xff21 - 0xff10] & 0xf8)) {
+      shadow->chan_on |= 0x8;
+    }
+    break;
+  }
 }
 
 static uint8_t audio_read(const uint16_t addr) {
-  return minigb_apu_audio_read(&g_apu_ctx, addr);
+  struct priv_audio_s * const audio = audio_instance;
+
+  PROFILE_COUNT(g_profile.apu_read[(addr - 0xff10) % PROFILE_APU_REGS]);
+  if (audio->async) {
+    return _apu_shadow_read(audio, addr);
+  }
+  return minigb_apu_audio_read(&audio->apu, addr);
 }
 
 static void audio_write(const uint16_t addr, const uint8_t val) {
-  minigb_apu_audio_write(&g_apu_ctx, addr, val);
+  struct priv_audio_s * const audio = audio_instance;
+
+  PROFILE_COUNT(g_profile.apu_write[(addr - 0xff10) % PROFILE_APU_REGS]);
+  if (audio->async) {
+    _apu_shadow_write(audio, addr, val);
+    _apu_log_append(audio, addr, val);
+    return;
+  }
+  _apu_track_write(audio, addr, val);
+  minigb_apu_audio_write(&audio->apu, addr, val);
 }
 #else
-#ifndef AUDIO_SAMPLES_TOTAL
-#define AUDIO_SAMPLES_TOTAL AUDIO_SAMPLES * 2
-#endif
-typedef int16_t audio_sample_t;
-static void audio_callback_wrapper(audio_sample_t *samples) {
+/* The legacy minigb_apu keeps its state in globals and can only be used by one instance. */
+static void _audio_init(struct priv_audio_s *audio) {
+  audio_init();
+  audio->silent_frames = 0;
+}
+
+static void audio_callback_wrapper(struct priv_audio_s *audio, audio_sample_t *samples) {
+  (void) audio;
   audio_callback(NULL, (uint8_t *) samples, AUDIO_SAMPLES_TOTAL * 2);
 }
+
+static inline bool _apu_can_output(const struct priv_audio_s * const audio) {
+  (void) audio;
+  return true;
+}
 #endif  // LEGACY_APU
 
 #include "peanut_gb.h"
@@ -101,6 +367,18 @@ typedef enum {
   MULTI_PRESS_MODE_NATIVE_S3C,
 } multi_press_mode_t;
 
+typedef enum {
+  INPUT_MOVIE_OFF = 0,
+  INPUT_MOVIE_RECORD,
+  INPUT_MOVIE_PLAY,
+} input_movie_mode_t;
+
+typedef enum {
+  SCALE_MODE_OFF = 0,
+  SCALE_MODE_INTEGER,
+  SCALE_MODE_FIT,
+} scale_mode_t;
+
 enum emu_key_e {
   EMU_KEY_QUIT = 1,
   EMU_KEY_MUTE = 1 << 1,
@@ -138,8 +416,14 @@ struct key_binding_s {
 static int _audio_worker(void *user_data);
 static int _input_dis_worker(void *user_data);
 static int _input_s3c_worker(void *user_data);
-static unsigned int _map_emu_key_state(unsigned short key);
-static uint8_t _map_pad_state(unsigned short key);
+static int _present_worker(void *user_data);
+void lcd_draw_line_fast_xrgb_scaled(struct gb_s *gb, const uint8_t pixels[160], const uint_fast8_t line);
+void lcd_draw_line_fast_rgb565_scaled(struct gb_s *gb, const uint8_t pixels[160], const uint_fast8_t line);
+void lcd_draw_line_fast_p4(struct gb_s *gb, const uint8_t pixels[160], const uint_fast8_t line);
+void lcd_draw_line_fast_p4_sa7101_t1(struct gb_s *gb, const uint8_t pixels[160], const uint_fast8_t line);
+void lcd_draw_line_fast_p4_sa7101_t2(struct gb_s *gb, const uint8_t pixels[160], const uint_fast8_t line);
+static unsigned int _map_emu_key_state(const struct key_binding_s * const binding, unsigned short key);
+static uint8_t _map_pad_state(const struct key_binding_s * const binding, unsigned short key);
 static void exit_cleanup(const struct gb_s * const gb);
 static int messagebox_format(unsigned short type, const char *fmt, ...);
 
@@ -173,14 +457,26 @@ const uint8_t COLOR_MAP_CGB[32] = {
   0x84, 0x8c, 0x94, 0x9c, 0xa5, 0xad, 0xb5, 0xbd,
   0xc5, 0xce, 0xd6, 0xde, 0xe6, 0xef, 0xf7, 0xff
 };
-uint16_t *color_map_cgb_16 = NULL;
-uint32_t *color_map_cgb_32 = NULL;
 #endif
 
+/* Copy of the MBC lookup table in gb_init(), only used to warn before the whole ROM is read. gb_init() has the final
+   say. 0xff marks unsupported cartridge types. */
+static const uint8_t CART_MBC[] = {
+  0, 1, 1, 1, 0xff, 2, 2, 0xff, 0, 0, 0xff, 0, 0, 0, 0xff, 3,
+  3, 3, 3, 3, 0xff, 0xff, 0xff, 0xff, 0xff, 5, 5, 5, 5, 5, 5, 0xff
+};
+
 const char SAVE_FILE_SUFFIX[] = ".sav";
+const char MOVIE_FILE_SUFFIX[] = ".wbm";
 
 const char CONFIG_PATH[] = "C:\\APPS\\woodyboy\\wb.ini";
 const char CONFIG_PATH_LEGACY[] = "C:\\SYSTEM\\muteki\\pgbcfg.ini";
+const char MEMORY_LOG_PATH[] = "C:\\APPS\\woodyboy\\mem.log";
+const char BENCHMARK_PATH[] = "C:\\APPS\\woodyboy\\bench.txt";
+const char TIMING_CACHE_PATH[] = "C:\\APPS\\woodyboy\\timing.dat";
+#if WB_PROFILE
+const char PROFILE_PATH[] = "C:\\APPS\\woodyboy\\profile.txt";
+#endif
 const char BOOT_ROM_PATH[] = "C:\\APPS\\woodyboy\\dmg_boot.bin";
 #if PEANUT_FULL_GBC_SUPPORT
 const char BOOT_ROM_CGB_PATH[] = "C:\\APPS\\woodyboy\\cgb_boot.bin";
@@ -190,36 +486,204 @@ const key_press_event_config_t KEY_EVENT_CONFIG_DRAIN = {65535, 65535, 1};
 const key_press_event_config_t KEY_EVENT_CONFIG_SUPPRESS = {65535, 65535, 0};
 const key_press_event_config_t KEY_EVENT_CONFIG_TURBO = {0, 0, 0};
 
-volatile unsigned int emu_key_state = 0, pad_key_state = 0;
-volatile bool holding_any_key = false;
-volatile bool power_event = false;
-volatile uint8_t audio_buffer_consumer_offset;
-volatile uint8_t audio_buffer_producer_offset;
-volatile bool audio_running = false;
-volatile bool tim1_emulator_running = false;
 volatile unsigned short sched_timer_ticks = 0;
-audio_sample_t *audio_buffer = NULL;
-thread_t *audio_worker_inst = NULL;
-thread_t *input_worker_inst = NULL;
 thread_t *sched_timer_worker_inst = NULL;
-event_t *audio_shutdown_ack = NULL;
-event_t *input_poller_shutdown_ack = NULL;
 
-static struct key_binding_s g_key_binding = {0};
+/* Raw (palette index) frame for the present worker. */
+struct present_frame_s {
+  uint8_t pixels[LCD_HEIGHT][LCD_WIDTH];
+  bool valid[LCD_HEIGHT];
+};
+
+#define ROM_HEADER_OFFSET 0x134
+#define ROM_HEADER_SIZE (0x14e - ROM_HEADER_OFFSET)
+
+/* Cartridge header fields checked before the whole ROM is loaded. */
+struct rom_header_s {
+  uint8_t cgb_flag;
+  uint8_t cart_type;
+  bool checksum_ok;
+};
+
+#define TIMING_CACHE_MAGIC 0x32435457u  // "WTC2"
+#define TIMING_PROBE_MS 16
+#define TIMING_PROBE_ROUNDS 4
+#define TIMING_RTC_PROBE_USECS 50000
+#define TIMING_HOLD_PROBE_SECS 5
+
+/* Timing behavior of the board, measured once and cached in TIMING_CACHE_PATH. */
+struct timing_calibration_s {
+  uint32_t magic;
+  /* Board signature. The cache is measured again if any of these differ. */
+  uint16_t lcd_width;
+  uint16_t lcd_height;
+  uint16_t lcd_depth;
+  uint16_t quantum;
+  /* Actual length of OSSleep(TIMING_PROBE_MS), in microseconds. */
+  uint32_t sleep_usecs;
+  /* Number of millis changes of GetSysTime() seen in TIMING_RTC_PROBE_USECS. */
+  uint32_t rtc_millis_steps;
+  /* Speed of the scheduler clock while a key is held relative to when none is, in 8.8 fixed point. Measured during
+     play, 0 until then. */
+  uint32_t hold_scale;
+};
+
+/* Whole RTC seconds of play timed with the scheduler clock, split by whether a key was held through all of it. */
+struct timing_hold_probe_s {
+  bool active;
+  time_t last_second;
+  unsigned long long last_usecs;
+  bool held_all;
+  bool released_all;
+  unsigned short held_secs;
+  unsigned short released_secs;
+  unsigned long long held_usecs;
+  unsigned long long released_usecs;
+};
+
+#define INPUT_MOVIE_MAGIC 0x314d4257u  // "WBM1"
+#define INPUT_MOVIE_FLAG_RESET 0x01
+
+/* Input movie file header. The RTC fields seed the cartridge clock so that playback starts from the same time. */
+struct input_movie_header_s {
+  uint32_t magic;
+  uint16_t rtc_sec;
+  uint16_t rtc_min;
+  uint16_t rtc_hour;
+  uint16_t rtc_yday;
+};
+
+/* A run of consecutive frames with the same joypad state and flags. The movie body is a sequence of these. */
+struct input_movie_run_s {
+  uint16_t frames;
+  uint8_t joypad;
+  uint8_t flags;
+};
 
 struct priv_config_s {
   short button_hold_compensation_num;
   short button_hold_compensation_denom;
   multi_press_mode_t multi_press_mode;
+  input_movie_mode_t debug_input_movie;
+  scale_mode_t scale;
+  unsigned int debug_benchmark_frames;
   int l4_lcd_type;
   bool enable_audio;
+  bool async_audio;
+  bool present_thread;
+  bool static_screen_idle;
+  bool auto_timing;
+  bool live_joypad;
+  bool fit_height;
   bool interlace;
   bool half_refresh;
   bool sram_auto_commit;
   bool sync_rtc_on_resume;
   bool use_boot_rom;
+  bool low_memory_mode;
   bool debug_show_delay_factor;
   bool debug_force_safe_framebuffer;
+  bool debug_memory_report;
+  bool debug_show_silent_audio_frames;
+};
+
+/* Sizes (in bytes) of the major heap allocations, for the memory report. */
+struct priv_mem_s {
+  size_t rom;
+  size_t cart_ram;
+  size_t boot_rom;
+  size_t cgb_table;
+  size_t audio_buffer;
+  size_t worker_stacks;
+  size_t framebuffer;
+};
+
+/* Frame pacing method. */
+struct priv_timing_s {
+  /* Pace with sleep_with_double_rtc() instead of OSSleep(). */
+  bool rtc_sleep;
+  /* OSSleep() argument per requested millisecond, in 8.8 fixed point. */
+  unsigned short sleep_scale;
+  /* Scheduler clock speed while a key is held, in 8.8 fixed point. 0 if not known (yet). */
+  unsigned short hold_scale;
+  /* Cached calibration, written back once hold_scale has been measured. */
+  struct timing_calibration_s cal;
+  struct timing_hold_probe_s hold_probe;
+};
+
+/* Input movie recording or playback state. */
+struct priv_movie_s {
+  input_movie_mode_t mode;
+  FILE *file;
+  /* Run being recorded, or the remainder of the run being played back. */
+  struct input_movie_run_s run;
+};
+
+/* Mapping of the 160x144 image onto the surface for the scaled blitters. Source column x covers destination columns
+   col_start[x] to col_start[x + 1] - 1, and source line y covers destination rows row_start[y] to row_start[y + 1] - 1. */
+struct priv_scale_s {
+  unsigned short col_start[LCD_WIDTH + 1];
+  unsigned short row_start[LCD_HEIGHT + 1];
+  /* Integer scale factor, or 0 if the image is scaled by a fractional factor. */
+  unsigned short factor;
+  /* Distance between two destination rows, in pixels. */
+  size_t stride;
+};
+
+/* Fit-to-height state for the L4 blitters. Every group of 3 source lines a, b, c is drawn as 2 output lines
+   (2a + b) / 3 and (b + 2c) / 3, which maps all 144 lines onto 96. */
+struct priv_fit_s {
+  /* blend[(x << 4) | y] is (2x + y) / 3 for 4-bit shades x and y. */
+  uint8_t blend[256];
+  /* Shades of a and b of the current group. */
+  uint8_t lines[2][LCD_WIDTH];
+};
+
+/* Change tracking used to skip blitting lines that are identical to the previous frame. */
+struct priv_screen_s {
+  /* Copy of every line as it was last blitted. */
+  uint8_t (*lines)[LCD_WIDTH];
+  /* Lines that have to be blitted regardless of their contents, e.g. after a dialog was drawn over the screen. A line
+     stays stale until it actually reaches the blitter, so frames skipped by HalfRefresh or Interlace don't lose it. */
+  bool stale[LCD_HEIGHT];
+  /* At least one line was blitted during the current frame. */
+  bool changed;
+  unsigned short static_frames;
+  /* Set while the screen has been static for STATIC_SCREEN_FRAMES frames. Read by the input worker. */
+  volatile bool idle;
+};
+
+/* Key state shared between the input worker and loop(). */
+struct priv_input_s {
+  volatile unsigned int emu_key_state;
+  volatile unsigned int pad_key_state;
+  volatile bool holding_any_key;
+  volatile bool power_event;
+  volatile bool running;
+  /* The worker is parked on resume, e.g. while the quit dialog is shown. */
+  volatile bool paused;
+  thread_t *worker_inst;
+  event_t *shutdown_ack;
+  event_t *pause_ack;
+  event_t *resume;
+
+  /* Ticker state. */
+  ui_event_t uievent;
+  uint_fast16_t down_counter;
+  short pressing0;
+  short pressing1;
+};
+
+/* Present worker state. The core renders into frames[capture] while the worker converts and blits the other one. */
+struct priv_present_s {
+  struct present_frame_s *frames;
+  uint8_t capture;
+  volatile uint8_t buffer;
+  /* Set by loop() when a captured frame is handed over, cleared by the present worker once it is on screen. */
+  volatile bool pending;
+  volatile bool running;
+  thread_t *worker_inst;
+  event_t *shutdown_ack;
 };
 
 struct priv_s {
@@ -243,6 +707,11 @@ struct priv_s {
   unsigned short yskip;
   unsigned short width;
   unsigned short height;
+  /* Only used by the scaled blitters. */
+  struct priv_scale_s scale;
+  /* The L4 blitters blend the whole image into 96 lines. Scrolling is disabled since height is LCD_HEIGHT. */
+  bool fit_height;
+  struct priv_fit_s fit;
   /* This needs to be the longer side of the width and height for it to support rotation. */
   size_t surface_yoff[LCD_WIDTH];
 
@@ -252,13 +721,43 @@ struct priv_s {
   /* Direct Input Simulation (DIS) and sound emulation state. */
   bool dis_active;
   bool sound_on;
+  /* The audio worker and buffers are kept while muted. */
+  bool sound_parked;
+  struct priv_audio_s audio;
+  /* The input worker publishes the joypad state straight to the core. */
+  bool live_joypad;
+  struct priv_input_s input;
+  struct key_binding_s key_binding;
+  struct priv_movie_s movie;
+  struct priv_timing_s timing;
+
+  /* Line callback selected for the surface. */
+  void (*lcd_draw_line)(struct gb_s *gb, const uint8_t pixels[160], const uint_fast8_t line);
+  /* Line conversion and blitting are done on the present worker. The core only captures raw lines. */
+  bool present_thread;
+  struct priv_present_s present;
+
+  /* Lines are passed through lcd_draw_line_if_changed() before reaching the blitter. */
+  bool skip_static_lines;
+  struct priv_screen_s screen;
+
+#if PEANUT_FULL_GBC_SUPPORT
+  /* CGB color lookup tables for the fast blitters. */
+  uint16_t *color_map_cgb_16;
+  uint32_t *color_map_cgb_32;
+#endif
 
   /* Use fallback blit algorithm. */
   bool fallback_blit;
   bool p4_1line_buffer;
 
+  /* Low memory mode. Either forced by config or entered when an allocation for a faster structure fails. */
+  bool low_memory;
+  struct priv_mem_s mem;
+
   /* Filenames for future reference. */
   char save_file_name[FILEPICKER_CONTEXT_OUTPUT_MAX_LFN * 3 + sizeof(SAVE_FILE_SUFFIX)];
+  char movie_file_name[FILEPICKER_CONTEXT_OUTPUT_MAX_LFN * 3 + sizeof(MOVIE_FILE_SUFFIX)];
   char rom_file_name[FILEPICKER_CONTEXT_OUTPUT_MAX_LFN * 3];
 
   struct priv_config_s config;
@@ -272,82 +771,189 @@ static inline bool _test_events_no_shift(ui_event_t *uievent) {
     return TestPendEvent(uievent) || TestKeyEvent(uievent);
 }
 
-static inline void _ext_ticker_s3c(void) {
-  static ui_event_t uievent = {0};
-  unsigned int emu_key_state_local = emu_key_state, pad_key_state_local = pad_key_state;
+static inline void _ext_ticker_s3c(struct priv_s *priv) {
+  struct priv_input_s * const input = &priv->input;
+  const struct key_binding_s * const binding = &priv->key_binding;
+  ui_event_t * const uievent = &input->uievent;
+  unsigned int emu_key_state_local = input->emu_key_state, pad_key_state_local = input->pad_key_state;
 
   /* TODO: what about single-shot events? Do we still need to request (lower rate) event
      spamming so we know whether a single-shot was held-down? */
-  while ((TestPendEvent(&uievent) || TestKeyEvent(&uievent)) && GetEvent(&uievent)) {
-    if (uievent.event_type == UI_EVENT_TYPE_KEY) {
-      if (uievent.key_code0 == KEY_POWER) {
-        power_event = true;
+  while ((TestPendEvent(uievent) || TestKeyEvent(uievent)) && GetEvent(uievent)) {
+    if (uievent->event_type == UI_EVENT_TYPE_KEY) {
+      if (uievent->key_code0 == KEY_POWER) {
+        input->power_event = true;
       } else {
-        pad_key_state_local |= _map_pad_state(uievent.key_code0);
-        emu_key_state_local |= _map_emu_key_state(uievent.key_code0);
+        pad_key_state_local |= _map_pad_state(binding, uievent->key_code0);
+        emu_key_state_local |= _map_emu_key_state(binding, uievent->key_code0);
       }
-    } else if (uievent.event_type == UI_EVENT_TYPE_KEY_UP) {
-      pad_key_state_local &= ~_map_pad_state(uievent.key_code0);
-      emu_key_state_local &= ~_map_emu_key_state(uievent.key_code0);
+    } else if (uievent->event_type == UI_EVENT_TYPE_KEY_UP) {
+      pad_key_state_local &= ~_map_pad_state(binding, uievent->key_code0);
+      emu_key_state_local &= ~_map_emu_key_state(binding, uievent->key_code0);
     }
   }
 
   /* BUG: This will cause the scheduler timer compensation to be skipped when an unsupported key was held-down.
      There's nothing we can do about this at the moment since we can't tell apart which events were
      single-shot or not. */
-  holding_any_key = pad_key_state_local || emu_key_state_local;
-  pad_key_state = pad_key_state_local;
-  emu_key_state = emu_key_state_local;
+  input->holding_any_key = pad_key_state_local || emu_key_state_local;
+  input->pad_key_state = pad_key_state_local;
+  input->emu_key_state = emu_key_state_local;
 }
 
-static inline void _ext_ticker_dis(void) {
-  static ui_event_t uievent = {0};
-  static uint_fast16_t down_counter = 0;
-  static short pressing0 = 0, pressing1 = 0;
+static inline void _ext_ticker_dis(struct priv_s *priv) {
+  struct priv_input_s * const input = &priv->input;
+  const struct key_binding_s * const binding = &priv->key_binding;
+  ui_event_t * const uievent = &input->uievent;
   bool hit = false;
 
   /* TODO this still seem to lose track presses on BA110. Find out why. */
-  if (down_counter <= 3) {
-    while (_test_events_no_shift(&uievent)) {
+  if (input->down_counter <= 3) {
+    while (_test_events_no_shift(uievent)) {
       hit = true;
-      if (GetEvent(&uievent) && uievent.event_type == UI_EVENT_TYPE_KEY) {
-        if (uievent.key_code0 == KEY_POWER || uievent.key_code1 == KEY_POWER) {
+      if (GetEvent(uievent) && uievent->event_type == UI_EVENT_TYPE_KEY) {
+        if (uievent->key_code0 == KEY_POWER || uievent->key_code1 == KEY_POWER) {
           hit = false;
-          down_counter = 1;
-          power_event = true;
+          input->down_counter = 1;
+          input->power_event = true;
         } else {
-          pressing0 = uievent.key_code0;
-          pressing1 = uievent.key_code1;
-          down_counter = 7;
+          input->pressing0 = uievent->key_code0;
+          input->pressing1 = uievent->key_code1;
+          input->down_counter = 7;
         }
       } else {
-        ClearEvent(&uievent);
+        ClearEvent(uievent);
       }
     }
   }
 
   if (!hit) {
-    if (down_counter == 1) {
-      pressing0 = 0;
-      pressing1 = 0;
-      down_counter = 0;
+    if (input->down_counter == 1) {
+      input->pressing0 = 0;
+      input->pressing1 = 0;
+      input->down_counter = 0;
+    }
+    if (input->down_counter != 0) {
+      input->down_counter--;
+    }
+  }
+
+  input->holding_any_key = input->pressing0 || input->pressing1;
+  input->pad_key_state = _map_pad_state(binding, input->pressing0) | _map_pad_state(binding, input->pressing1);
+  input->emu_key_state = (
+    _map_emu_key_state(binding, input->pressing0) | _map_emu_key_state(binding, input->pressing1)
+  );
+}
+
+/* Synthesize one frame of audio into ring slot. */
+static void _audio_produce(struct priv_audio_s *audio, uint8_t slot) {
+  audio_sample_t *out = &audio->buffer[slot * AUDIO_SAMPLES_TOTAL];
+
+  if (!_apu_can_output(audio)) {
+    memset(out, 0, AUDIO_SAMPLES_TOTAL * sizeof(*out));
+    audio->silent_frames++;
+  } else {
+    audio_callback_wrapper(audio, out);
+  }
+}
+
+#ifndef LEGACY_APU
+static void _apu_log_replay(struct priv_audio_s *audio, struct apu_write_log_s *log) {
+  for (size_t i = 0; i < log->count; i++) {
+    _apu_track_write(audio, log->writes[i].addr, log->writes[i].val);
+    minigb_apu_audio_write(&audio->apu, log->writes[i].addr, log->writes[i].val);
+  }
+  log->count = 0;
+}
+
+/* Hand the pending log over to the audio worker through ring slot. The slot must be free. */
+static void _apu_log_submit(struct priv_audio_s *audio, uint8_t slot, bool synthesize) {
+  struct apu_write_log_s *log = audio->pending_log;
+
+  audio->pending_log = audio->slot_log[slot];
+  audio->slot_log[slot] = log;
+  log->synthesize = synthesize;
+
+  slot++;
+  slot &= audio->ring_mask;
+  audio->producer_offset = slot;
+}
+
+static void _apu_log_append(struct priv_audio_s *audio, const uint16_t addr, const uint8_t val) {
+  struct apu_write_log_s *log = audio->pending_log;
+
+  if (log->count >= APU_WRITE_LOG_SIZE) {
+    /* Hand off the full log without synthesizing, waiting for the worker to free up a slot if necessary. */
+    uint8_t pbuf = audio->producer_offset;
+    while (((pbuf + 1) & audio->ring_mask) == audio->consumer_offset && audio->running) {
+      OSSleep(1);
     }
-    if (down_counter != 0) {
-      down_counter--;
+    if (audio->running) {
+      _apu_log_submit(audio, pbuf, false);
+      log = audio->pending_log;
+    } else {
+      /* The worker is gone. Nobody else owns the APU context. */
+      _apu_log_replay(audio, log);
     }
   }
 
-  holding_any_key = pressing0 || pressing1;
-  pad_key_state = _map_pad_state(pressing0) | _map_pad_state(pressing1);
-  emu_key_state = _map_emu_key_state(pressing0) | _map_emu_key_state(pressing1);
+  log->writes[log->count].addr = addr;
+  log->writes[log->count].val = val;
+  log->count++;
+}
+
+static bool _apu_log_init(struct priv_audio_s *audio, size_t slots) {
+  audio->write_logs = calloc(slots + 1, sizeof(*audio->write_logs));
+  if (audio->write_logs == NULL) {
+    return false;
+  }
+  for (size_t i = 0; i < slots; i++) {
+    audio->slot_log[i] = &audio->write_logs[i];
+  }
+  audio->pending_log = &audio->write_logs[slots];
+  return true;
+}
+
+/* Apply all writes that the stopped or parked worker didn't get to, and give the APU context back to the emulator
+   thread. The logs are kept for when the worker resumes. */
+static void _apu_log_flush(struct priv_audio_s *audio) {
+  uint8_t cbuf = audio->consumer_offset;
+
+  while (cbuf != audio->producer_offset) {
+    _apu_log_replay(audio, audio->slot_log[cbuf]);
+    cbuf++;
+    cbuf &= audio->ring_mask;
+  }
+  _apu_log_replay(audio, audio->pending_log);
+
+  audio->async = false;
+}
+
+static void _apu_log_fini(struct priv_audio_s *audio) {
+  _apu_log_flush(audio);
+  free(audio->write_logs);
+  audio->write_logs = NULL;
+  audio->pending_log = NULL;
+}
+#endif
+
+/* Park the calling worker until it is resumed or shut down. */
+static void _worker_park(volatile bool *paused, volatile bool *running, event_t *ack, event_t *resume) {
+  OSSetEvent(ack);
+  while (*paused && *running) {
+    OSWaitForEvent(resume, 1000);
+    OSResetEvent(resume);
+  }
 }
 
 static int _audio_worker(void *user_data) {
-  (void) user_data;
+  struct gb_s *gb = user_data;
+  struct priv_s *priv = gb->direct.priv;
+  struct priv_audio_s * const audio = &priv->audio;
 
-  OSResetEvent(audio_shutdown_ack);
+  OSResetEvent(audio->shutdown_ack);
 
-  audio_running = true;
+  audio->running = true;
 
   size_t actual_size;
   pcm_codec_context_t *pcmdesc = NULL;
@@ -355,24 +961,44 @@ static int _audio_worker(void *user_data) {
 
   pcmdesc = OpenPCMCodec(DIRECTION_OUT, AUDIO_SAMPLE_RATE, FORMAT_PCM_STEREO);
   if (pcmdesc == NULL) {
-    audio_running = false;
+    audio->running = false;
+    OSSetEvent(audio->shutdown_ack);
     return 0;
   }
 
   pcmdev = CreateFile("\\\\?\\PCM", 0, 0, NULL, 3, 0, NULL);
   if (pcmdev == NULL || pcmdev == DEVIO_DESC_INVALID) {
     ClosePCMCodec(pcmdesc);
-    audio_running = false;
+    audio->running = false;
+    OSSetEvent(audio->shutdown_ack);
     return 0;
   }
 
-  while (audio_running) {
-    uint8_t cbuf = audio_buffer_consumer_offset;
-    if (cbuf != audio_buffer_producer_offset) {
-      WriteFile(pcmdev, &audio_buffer[cbuf * AUDIO_SAMPLES_TOTAL], AUDIO_SAMPLES_TOTAL * 2, &actual_size, NULL);
+  while (audio->running) {
+    if (audio->paused) {
+      _worker_park(&audio->paused, &audio->running, audio->pause_ack, audio->resume);
+      continue;
+    }
+    uint8_t cbuf = audio->consumer_offset;
+    if (cbuf != audio->producer_offset) {
+#ifndef LEGACY_APU
+      if (audio->async) {
+        struct apu_write_log_s *log = audio->slot_log[cbuf];
+        bool synthesize = log->synthesize;
+        _apu_log_replay(audio, log);
+        if (!synthesize) {
+          cbuf++;
+          cbuf &= audio->ring_mask;
+          audio->consumer_offset = cbuf;
+          continue;
+        }
+        _audio_produce(audio, cbuf);
+      }
+#endif
+      WriteFile(pcmdev, &audio->buffer[cbuf * AUDIO_SAMPLES_TOTAL], AUDIO_SAMPLES_TOTAL * 2, &actual_size, NULL);
       cbuf++;
-      cbuf &= 3;
-      audio_buffer_consumer_offset = cbuf;
+      cbuf &= audio->ring_mask;
+      audio->consumer_offset = cbuf;
     } else {
       /* Yield from thread for more audio data. */
       OSSleep(1);
@@ -388,7 +1014,7 @@ static int _audio_worker(void *user_data) {
     pcmdesc = NULL;
   }
 
-  OSSetEvent(audio_shutdown_ack);
+  OSSetEvent(audio->shutdown_ack);
 
   return 0;
 }
@@ -399,17 +1025,26 @@ APCS_WRAPPER_STATIC(audio_worker_thread_entry, va, int, void *) {
 }
 
 static int _input_dis_worker(void *user_data) {
-  (void) user_data;
+  struct gb_s *gb = user_data;
+  struct priv_s *priv = gb->direct.priv;
 
-  OSResetEvent(input_poller_shutdown_ack);
+  OSResetEvent(priv->input.shutdown_ack);
 
-  tim1_emulator_running = true;
+  priv->input.running = true;
 
-  while (tim1_emulator_running) {
-    _ext_ticker_dis();
+  while (priv->input.running) {
+    if (priv->input.paused) {
+      _worker_park(&priv->input.paused, &priv->input.running, priv->input.pause_ack, priv->input.resume);
+      continue;
+    }
+    _ext_ticker_dis(priv);
+    if (priv->live_joypad) {
+      /* The core reads this on every P1 access, so games see the new state mid-frame. */
+      gb->direct.joypad = ~priv->input.pad_key_state;
+    }
     OSSleep(5);
   }
-  OSSetEvent(input_poller_shutdown_ack);
+  OSSetEvent(priv->input.shutdown_ack);
 
   return 0;
 }
@@ -420,17 +1055,27 @@ APCS_WRAPPER_STATIC(input_dis_worker_thread_entry, va, int, void *) {
 }
 
 static int _input_s3c_worker(void *user_data) {
-  (void) user_data;
+  struct gb_s *gb = user_data;
+  struct priv_s *priv = gb->direct.priv;
 
-  OSResetEvent(input_poller_shutdown_ack);
+  OSResetEvent(priv->input.shutdown_ack);
 
-  tim1_emulator_running = true;
+  priv->input.running = true;
 
-  while (tim1_emulator_running) {
-    _ext_ticker_s3c();
-    OSSleep(15);
+  while (priv->input.running) {
+    if (priv->input.paused) {
+      _worker_park(&priv->input.paused, &priv->input.running, priv->input.pause_ack, priv->input.resume);
+      continue;
+    }
+    _ext_ticker_s3c(priv);
+    if (priv->live_joypad) {
+      /* The core reads this on every P1 access, so games see the new state mid-frame. */
+      gb->direct.joypad = ~priv->input.pad_key_state;
+    }
+    /* Key events are queued by the system, so polling less often on a static screen only adds latency. */
+    OSSleep(priv->screen.idle ? 30 : 15);
   }
-  OSSetEvent(input_poller_shutdown_ack);
+  OSSetEvent(priv->input.shutdown_ack);
 
   return 0;
 }
@@ -440,6 +1085,42 @@ APCS_WRAPPER_STATIC(input_s3c_worker_thread_entry, va, int, void *) {
   return _input_s3c_worker(user_data);
 }
 
+static int _present_worker(void *user_data) {
+  struct gb_s *gb = user_data;
+  struct priv_s * const priv = gb->direct.priv;
+  struct priv_present_s * const present = &priv->present;
+
+  OSResetEvent(present->shutdown_ack);
+
+  present->running = true;
+
+  while (present->running) {
+    if (present->pending) {
+      const struct present_frame_s * const frame = &present->frames[present->buffer];
+      for (uint_fast8_t line = 0; line < LCD_HEIGHT; line++) {
+        if (frame->valid[line]) {
+          priv->lcd_draw_line(gb, frame->pixels[line], line);
+        }
+      }
+      if (priv->fallback_blit && !priv->p4_1line_buffer) {
+        _BitBlt(priv->real_fb, priv->canvas_x, priv->canvas_y, priv->width, priv->height, priv->fb, 0, 0, BLIT_NONE);
+      }
+      present->pending = false;
+    } else {
+      /* Yield from thread for the next frame. */
+      OSSleep(1);
+    }
+  }
+  OSSetEvent(present->shutdown_ack);
+
+  return 0;
+}
+
+APCS_WRAPPER_STATIC(present_worker_thread_entry, va, int, void *) {
+  void *user_data = va_arg(va, void *);
+  return _present_worker(user_data);
+}
+
 static inline void _drain_all_events(void) {
   ui_event_t uievent = {0};
   size_t silence_count = 0;
@@ -456,15 +1137,29 @@ static inline void _drain_all_events(void) {
 
 static void _input_poller_begin(struct gb_s *gb) {
   struct priv_s *priv = gb->direct.priv;
-  if (!priv->dis_active) {
-    emu_key_state = 0;
-    pad_key_state = 0;
+  if (priv->dis_active && priv->input.paused) {
+    /* Wake up the parked worker. */
+    priv->input.emu_key_state = 0;
+    priv->input.pad_key_state = 0;
+    GetSysKeyState(&priv->old_hold_cfg);
+    if (priv->config.multi_press_mode == MULTI_PRESS_MODE_DIS) {
+      SetSysKeyState(&KEY_EVENT_CONFIG_TURBO);
+    } else {
+      SetSysKeyState(&KEY_EVENT_CONFIG_SUPPRESS);
+    }
+    priv->input.paused = false;
+    OSSetEvent(priv->input.resume);
+  } else if (!priv->dis_active) {
+    priv->input.emu_key_state = 0;
+    priv->input.pad_key_state = 0;
 
     if (priv->config.multi_press_mode == MULTI_PRESS_MODE_DIS) {
       GetSysKeyState(&priv->old_hold_cfg);
 
-      input_poller_shutdown_ack = OSCreateEvent(true, 1);
-      input_worker_inst = OSCreateThread(&input_dis_worker_thread_entry, NULL, 16384, false);
+      priv->input.shutdown_ack = OSCreateEvent(true, 1);
+      priv->input.pause_ack = OSCreateEvent(true, 0);
+      priv->input.resume = OSCreateEvent(true, 0);
+      priv->input.worker_inst = OSCreateThread(&input_dis_worker_thread_entry, gb, WORKER_STACK_SIZE, false);
 
       SetSysKeyState(&KEY_EVENT_CONFIG_TURBO);
       OSSleep(1);
@@ -472,8 +1167,10 @@ static void _input_poller_begin(struct gb_s *gb) {
     } else if (priv->config.multi_press_mode == MULTI_PRESS_MODE_NATIVE_S3C) {
       GetSysKeyState(&priv->old_hold_cfg);
 
-      input_poller_shutdown_ack = OSCreateEvent(true, 1);
-      input_worker_inst = OSCreateThread(&input_s3c_worker_thread_entry, NULL, 16384, false);
+      priv->input.shutdown_ack = OSCreateEvent(true, 1);
+      priv->input.pause_ack = OSCreateEvent(true, 0);
+      priv->input.resume = OSCreateEvent(true, 0);
+      priv->input.worker_inst = OSCreateThread(&input_s3c_worker_thread_entry, gb, WORKER_STACK_SIZE, false);
 
       SetSysKeyState(&KEY_EVENT_CONFIG_SUPPRESS);
       OSSleep(1);
@@ -482,69 +1179,294 @@ static void _input_poller_begin(struct gb_s *gb) {
   }
 }
 
-static void _input_poller_end(struct gb_s *gb) {
+/* Hand the keyboard back to the system, e.g. for a dialog, but keep the worker around for _input_poller_begin(). */
+static void _input_poller_pause(struct gb_s *gb) {
+  struct priv_s *priv = gb->direct.priv;
+  if (priv->dis_active && !priv->input.paused) {
+    SetSysKeyState(&KEY_EVENT_CONFIG_DRAIN);
+
+    OSResetEvent(priv->input.pause_ack);
+    priv->input.paused = true;
+    while (OSWaitForEvent(priv->input.pause_ack, 1000) != WAIT_RESULT_RESOLVED) {};
+
+    _drain_all_events();
+
+    SetSysKeyState(&priv->old_hold_cfg);
+    priv->input.emu_key_state = 0;
+    priv->input.pad_key_state = 0;
+  }
+}
+
+static void _input_poller_end(struct gb_s *gb) {
+  struct priv_s *priv = gb->direct.priv;
+  if (priv->dis_active) {
+    /* A parked worker has already handed the keyboard back. */
+    bool paused = priv->input.paused;
+
+    /* TODO do we need to drain the input in S3C mode? */
+    if (!paused) {
+      SetSysKeyState(&KEY_EVENT_CONFIG_DRAIN);
+    }
+
+    priv->input.running = false;
+    OSSetEvent(priv->input.resume);
+    while (OSWaitForEvent(priv->input.shutdown_ack, 1000) != WAIT_RESULT_RESOLVED) {};
+    OSCloseEvent(priv->input.shutdown_ack);
+    OSCloseEvent(priv->input.pause_ack);
+    OSCloseEvent(priv->input.resume);
+    OSSleep(1);
+    if (priv->input.worker_inst != NULL) {
+      OSTerminateThread(priv->input.worker_inst, 0);
+      priv->input.worker_inst = NULL;
+    }
+
+    if (!paused) {
+      _drain_all_events();
+      SetSysKeyState(&priv->old_hold_cfg);
+    }
+
+    priv->input.emu_key_state = 0;
+    priv->input.pad_key_state = 0;
+    priv->input.paused = false;
+    priv->dis_active = false;
+  }
+}
+
+static void _sound_on(struct gb_s *gb) {
+  struct priv_s *priv = gb->direct.priv;
+  struct priv_audio_s * const audio = &priv->audio;
+
+  if (priv->sound_parked) {
+    /* Reuse the parked worker and its buffers. */
+    audio->consumer_offset = 0;
+    audio->producer_offset = 0;
+#ifndef LEGACY_APU
+    if (audio->write_logs != NULL) {
+      _apu_shadow_sync(audio);
+      audio->async = true;
+    }
+#endif
+    priv->sound_parked = false;
+    priv->sound_on = true;
+    audio->paused = false;
+    OSSetEvent(audio->resume);
+  } else if (!priv->sound_on) {
+    audio->consumer_offset = 0;
+    audio->producer_offset = 0;
+    if (audio->buffer != NULL) {
+      free(audio->buffer);
+      audio->buffer = NULL;
+    }
+
+    /* Fall back to a shorter ring (more prone to underruns) when memory is tight. */
+    size_t slots = AUDIO_RING_SLOTS;
+    if (!priv->low_memory) {
+      audio->buffer = calloc(sizeof(*audio->buffer) * slots, AUDIO_SAMPLES_TOTAL);
+    }
+    if (audio->buffer == NULL) {
+      priv->low_memory = true;
+      slots = AUDIO_RING_SLOTS_LOW_MEMORY;
+      audio->buffer = calloc(sizeof(*audio->buffer) * slots, AUDIO_SAMPLES_TOTAL);
+    }
+    if (audio->buffer == NULL) {
+      priv->mem.audio_buffer = 0;
+      return;
+    }
+    audio->ring_mask = slots - 1;
+    priv->mem.audio_buffer = sizeof(*audio->buffer) * slots * AUDIO_SAMPLES_TOTAL;
+
+#ifndef LEGACY_APU
+    /* Move synthesis to the audio worker. Stays synchronous if the logs can't be allocated. */
+    if (priv->config.async_audio && !priv->low_memory && _apu_log_init(audio, slots)) {
+      _apu_shadow_sync(audio);
+      audio->async = true;
+      priv->mem.audio_buffer += sizeof(*audio->write_logs) * (slots + 1);
+    }
+#endif
+
+    audio->paused = false;
+    audio->shutdown_ack = OSCreateEvent(true, 1);
+    audio->pause_ack = OSCreateEvent(true, 0);
+    audio->resume = OSCreateEvent(true, 0);
+    audio->worker_inst = OSCreateThread(&audio_worker_thread_entry, gb, WORKER_STACK_SIZE, false);
+    OSSleep(1);
+    priv->sound_on = true;
+  }
+}
+
+static void _sound_off(struct gb_s *gb) {
+  struct priv_s *priv = gb->direct.priv;
+  struct priv_audio_s * const audio = &priv->audio;
+
+  if (priv->sound_on || priv->sound_parked) {
+    audio->running = false;
+    OSSetEvent(audio->resume);
+    while (OSWaitForEvent(audio->shutdown_ack, 1000) != WAIT_RESULT_RESOLVED) {};
+    OSCloseEvent(audio->shutdown_ack);
+    OSCloseEvent(audio->pause_ack);
+    OSCloseEvent(audio->resume);
+    OSSleep(1);
+    if (audio->worker_inst != NULL) {
+      OSTerminateThread(audio->worker_inst, 0);
+      audio->worker_inst = NULL;
+    }
+#ifndef LEGACY_APU
+    if (audio->write_logs != NULL) {
+      _apu_log_fini(audio);
+    }
+#endif
+    if (audio->buffer != NULL) {
+      free(audio->buffer);
+      audio->buffer = NULL;
+    }
+    priv->mem.audio_buffer = 0;
+    priv->sound_on = false;
+    priv->sound_parked = false;
+  }
+}
+
+/* Mute by parking the audio worker. The PCM device, ring and APU logs are kept for the next _sound_on(). */
+static void _sound_pause(struct gb_s *gb) {
+  struct priv_s *priv = gb->direct.priv;
+  struct priv_audio_s * const audio = &priv->audio;
+
+  if (priv->sound_on) {
+    OSResetEvent(audio->pause_ack);
+    audio->paused = true;
+    while (OSWaitForEvent(audio->pause_ack, 1000) != WAIT_RESULT_RESOLVED && audio->running) {};
+    if (!audio->running) {
+      /* The worker exited on its own (e.g. the PCM device could not be opened). */
+      _sound_off(gb);
+      return;
+    }
+#ifndef LEGACY_APU
+    if (audio->async) {
+      _apu_log_flush(audio);
+    }
+#endif
+    priv->sound_on = false;
+    priv->sound_parked = true;
+  }
+}
+
+static void _present_begin(struct gb_s *gb) {
+  struct priv_s *priv = gb->direct.priv;
+
+  if (priv->present_thread || !priv->config.present_thread || priv->low_memory) {
+    return;
+  }
+#if PEANUT_FULL_GBC_SUPPORT
+  /* CGB palettes may change mid-frame and the blitters look them up at conversion time. */
+  if (gb->cgb.cgbMode) {
+    return;
+  }
+#endif
+
+  struct priv_present_s * const present = &priv->present;
+  present->frames = calloc(2, sizeof(*present->frames));
+  if (present->frames == NULL) {
+    return;
+  }
+  priv->mem.framebuffer += 2 * sizeof(*present->frames);
+  present->capture = 0;
+  present->buffer = 0;
+  present->pending = false;
+
+  present->shutdown_ack = OSCreateEvent(true, 1);
+  present->worker_inst = OSCreateThread(&present_worker_thread_entry, gb, WORKER_STACK_SIZE, false);
+  OSSleep(1);
+  priv->present_thread = true;
+}
+
+/* Wait until the frame handed to the present worker is on screen, e.g. before drawing a dialog. */
+static void _present_flush(const struct priv_s * const priv) {
+  while (priv->present.pending && priv->present.running) {
+    OSSleep(1);
+  }
+}
+
+static void _present_end(struct gb_s *gb) {
   struct priv_s *priv = gb->direct.priv;
-  if (priv->dis_active) {
-    /* TODO do we need to drain the input in S3C mode? */
-    SetSysKeyState(&KEY_EVENT_CONFIG_DRAIN);
 
-    tim1_emulator_running = false;
-    while (OSWaitForEvent(input_poller_shutdown_ack, 1000) != WAIT_RESULT_RESOLVED) {};
-    OSCloseEvent(input_poller_shutdown_ack);
+  if (priv->present_thread) {
+    struct priv_present_s * const present = &priv->present;
+    present->running = false;
+    while (OSWaitForEvent(present->shutdown_ack, 1000) != WAIT_RESULT_RESOLVED) {};
+    OSCloseEvent(present->shutdown_ack);
     OSSleep(1);
-    if (input_worker_inst != NULL) {
-      OSTerminateThread(input_worker_inst, 0);
-      input_worker_inst = NULL;
+    if (present->worker_inst != NULL) {
+      OSTerminateThread(present->worker_inst, 0);
+      present->worker_inst = NULL;
     }
-
-    _drain_all_events();
-
-    SetSysKeyState(&priv->old_hold_cfg);
-    emu_key_state = 0;
-    pad_key_state = 0;
-    priv->dis_active = false;
+    free(present->frames);
+    present->frames = NULL;
+    present->pending = false;
+    priv->mem.framebuffer -= 2 * sizeof(*present->frames);
+    priv->present_thread = false;
   }
 }
 
-static void _sound_on(struct gb_s *gb) {
-  struct priv_s *priv = gb->direct.priv;
+static inline bool _is_scaled_blitter(const struct priv_s * const priv) {
+  return (
+    priv->lcd_draw_line == &lcd_draw_line_fast_xrgb_scaled ||
+    priv->lcd_draw_line == &lcd_draw_line_fast_rgb565_scaled
+  );
+}
 
-  if (!priv->sound_on) {
-    audio_buffer_consumer_offset = 0;
-    audio_buffer_producer_offset = 0;
-    if (audio_buffer != NULL) {
-      free(audio_buffer);
-      audio_buffer = NULL;
-    }
-    audio_buffer = calloc(sizeof(*audio_buffer) * 4, AUDIO_SAMPLES_TOTAL);
-    if (audio_buffer == NULL) {
-      return;
-    }
-    audio_shutdown_ack = OSCreateEvent(true, 1);
-    audio_worker_inst = OSCreateThread(&audio_worker_thread_entry, NULL, 16384, false);
-    OSSleep(1);
-    priv->sound_on = true;
-  }
+static inline bool _is_l4_blitter(const struct priv_s * const priv) {
+  return (
+    (priv->lcd_draw_line == &lcd_draw_line_fast_p4 && priv->p4_1line_buffer) ||
+    priv->lcd_draw_line == &lcd_draw_line_fast_p4_sa7101_t1 ||
+    priv->lcd_draw_line == &lcd_draw_line_fast_p4_sa7101_t2
+  );
 }
 
-static void _sound_off(struct gb_s *gb) {
+/* Centre the scaled image on a ww x hh surface and build the column and row maps. Falls back to 1x (i.e. the same
+   placement as the unscaled blitters) when the surface is too small for the configured mode. */
+static void _set_scale_parameter(struct gb_s *gb, short ww, short hh) {
   struct priv_s *priv = gb->direct.priv;
+  struct priv_scale_s *scale = &priv->scale;
 
-  if (priv->sound_on) {
-    audio_running = false;
-    while (OSWaitForEvent(audio_shutdown_ack, 1000) != WAIT_RESULT_RESOLVED) {};
-    OSCloseEvent(audio_shutdown_ack);
-    OSSleep(1);
-    if (audio_worker_inst != NULL) {
-      OSTerminateThread(audio_worker_inst, 0);
-      audio_worker_inst = NULL;
+  unsigned int dst_w = LCD_WIDTH, dst_h = LCD_HEIGHT;
+  if (priv->config.scale == SCALE_MODE_FIT) {
+    if (ww * LCD_HEIGHT <= hh * LCD_WIDTH) {
+      dst_w = ww;
+      dst_h = ww * LCD_HEIGHT / LCD_WIDTH;
+    } else {
+      dst_w = hh * LCD_WIDTH / LCD_HEIGHT;
+      dst_h = hh;
     }
-    if (audio_buffer != NULL) {
-      free(audio_buffer);
-      audio_buffer = NULL;
+  } else {
+    unsigned int factor = (ww / LCD_WIDTH < hh / LCD_HEIGHT) ? ww / LCD_WIDTH : hh / LCD_HEIGHT;
+    if (factor > 1) {
+      dst_w = factor * LCD_WIDTH;
+      dst_h = factor * LCD_HEIGHT;
     }
-    priv->sound_on = false;
   }
+  /* Only scale up. */
+  if (dst_w < LCD_WIDTH || dst_h < LCD_HEIGHT) {
+    dst_w = LCD_WIDTH;
+    dst_h = LCD_HEIGHT;
+  }
+
+  if (dst_w % LCD_WIDTH == 0 && dst_h % LCD_HEIGHT == 0 && dst_w / LCD_WIDTH == dst_h / LCD_HEIGHT) {
+    scale->factor = dst_w / LCD_WIDTH;
+  } else {
+    scale->factor = 0;
+  }
+  for (size_t i = 0; i <= LCD_WIDTH; i++) {
+    scale->col_start[i] = i * dst_w / LCD_WIDTH;
+  }
+  for (size_t i = 0; i <= LCD_HEIGHT; i++) {
+    scale->row_start[i] = i * dst_h / LCD_HEIGHT;
+  }
+
+  /* Surfaces smaller than 160x144 are not scaled and are cropped like with the unscaled blitters. */
+  priv->canvas_x = (ww > (short) dst_w) ? (ww - dst_w) / 2 : 0;
+  priv->canvas_x_triplet = priv->canvas_x / 3;
+  priv->canvas_y = (hh > (short) dst_h) ? (hh - dst_h) / 2 : 0;
+  priv->width = (ww < LCD_WIDTH) ? ww : LCD_WIDTH;
+  priv->height = (hh < LCD_HEIGHT) ? hh : LCD_HEIGHT;
 }
 
 static void _set_blit_parameter(struct gb_s *gb, const lcd_surface_t * const surface) {
@@ -573,6 +1495,27 @@ static void _set_blit_parameter(struct gb_s *gb, const lcd_surface_t * const sur
     hh = surface->width;
   }
 
+  if (_is_scaled_blitter(priv)) {
+    _set_scale_parameter(gb, ww, hh);
+    return;
+  }
+
+  priv->fit_height = (
+    priv->config.fit_height && _is_l4_blitter(priv) && hh >= FIT_HEIGHT_LINES && hh < LCD_HEIGHT && ww >= LCD_WIDTH
+  );
+  if (priv->fit_height) {
+    for (unsigned int i = 0; i < 256; i++) {
+      priv->fit.blend[i] = (2 * (i >> 4) + (i & 0xf) + 1) / 3;
+    }
+    priv->canvas_x = (ww - LCD_WIDTH) / 2;
+    priv->canvas_x_triplet = priv->canvas_x / 3;
+    priv->canvas_y = (hh - FIT_HEIGHT_LINES) / 2;
+    priv->width = LCD_WIDTH;
+    priv->height = LCD_HEIGHT;
+    priv->yskip = 0;
+    return;
+  }
+
   int xoff = (ww - LCD_WIDTH) / 2, yoff = (hh - LCD_HEIGHT) / 2;
   if (xoff <= 0) {
     priv->canvas_x = 0;
@@ -618,7 +1561,9 @@ static void _precompute_yoff(struct gb_s *gb) {
     }
     for (size_t i = 0; i < LCD_WIDTH; i++) {
       priv->surface_yoff[i] = (x + i) * priv->fb->xsize + surface_xoff;
-      if (priv->fb->depth == LCD_SURFACE_PIXFMT_XRGB) {
+      if (priv->fb->depth == LCD_SURFACE_PIXFMT_RGB565) {
+        priv->surface_yoff[i] /= 2;
+      } else if (priv->fb->depth == LCD_SURFACE_PIXFMT_XRGB) {
         priv->surface_yoff[i] /= 4;
       }
     }
@@ -630,29 +1575,49 @@ static void _precompute_yoff(struct gb_s *gb) {
       surface_xoff = x / 2;
       break;
     case LCD_SURFACE_PIXFMT_RGB565:
-      surface_xoff = y * 2;
+      surface_xoff = x * 2;
       break;
     case LCD_SURFACE_PIXFMT_XRGB:
       surface_xoff = x * 4;
       break;
     }
 
+    /* The scaled blitters draw source line i starting at destination row row_start[i]. */
+    const bool scaled = _is_scaled_blitter(priv);
     for (size_t i = 0; i < LCD_HEIGHT; i++) {
-      priv->surface_yoff[i] = (y + i) * priv->fb->xsize + surface_xoff;
-      if (priv->fb->depth == LCD_SURFACE_PIXFMT_XRGB) {
+      const size_t row = scaled ? priv->scale.row_start[i] : i;
+      priv->surface_yoff[i] = (y + row) * priv->fb->xsize + surface_xoff;
+      if (priv->fb->depth == LCD_SURFACE_PIXFMT_RGB565) {
+        priv->surface_yoff[i] /= 2;
+      } else if (priv->fb->depth == LCD_SURFACE_PIXFMT_XRGB) {
         priv->surface_yoff[i] /= 4;
       }
     }
+    /* xsize is in bytes. The scaled blitters step rows in pixels. */
+    priv->scale.stride = priv->fb->xsize;
+    if (priv->fb->depth == LCD_SURFACE_PIXFMT_RGB565) {
+      priv->scale.stride /= 2;
+    } else if (priv->fb->depth == LCD_SURFACE_PIXFMT_XRGB) {
+      priv->scale.stride /= 4;
+    }
   }
 }
 
-static uint8_t *_read_file(const char *path, size_t size, bool allocate_anyway) {
+static uint8_t *_read_file(const char *path, size_t size, bool allocate_anyway, size_t *actual_size) {
   struct stat st = {0};
 
+  if (actual_size != NULL) {
+    *actual_size = 0;
+  }
+
   FILE *f = fopen(path, "rb");
   if (f == NULL) {
     if (allocate_anyway && size > 0) {
-      return (uint8_t *) calloc(size, sizeof(uint8_t));
+      uint8_t *content = (uint8_t *) calloc(size, sizeof(uint8_t));
+      if (content != NULL && actual_size != NULL) {
+        *actual_size = size;
+      }
+      return content;
     }
     return NULL;
   }
@@ -674,13 +1639,17 @@ static uint8_t *_read_file(const char *path, size_t size, bool allocate_anyway)
   fread(content, 1, size, f);
   fclose(f);
 
+  if (actual_size != NULL) {
+    *actual_size = size;
+  }
   return content;
 }
 
 static void _write_save(struct gb_s *gb, const char *path) {
   struct priv_s *priv = gb->direct.priv;
   size_t save_size = priv->cart_ram_size;
-  if (priv->cart_ram == NULL || save_size == 0) {
+  /* Movies always start from blank cartridge RAM. Don't let them overwrite the real save. */
+  if (priv->cart_ram == NULL || save_size == 0 || priv->movie.mode != INPUT_MOVIE_OFF) {
     return;
   }
   FILE *f = fopen(path, "wb");
@@ -696,39 +1665,39 @@ static void _write_save(struct gb_s *gb, const char *path) {
     state |= as; \
   }
 
-static unsigned int _map_emu_key_state(unsigned short key) {
+static unsigned int _map_emu_key_state(const struct key_binding_s * const binding, unsigned short key) {
   unsigned int state = 0;
 
-  _TEST_KEY(g_key_binding.quit, state, EMU_KEY_QUIT)
-  _TEST_KEY(g_key_binding.mute, state, EMU_KEY_MUTE)
-  _TEST_KEY(g_key_binding.reset_hard, state, EMU_KEY_RESET)
-  _TEST_KEY(g_key_binding.scroll_up, state, EMU_KEY_SCROLL_UP)
-  _TEST_KEY(g_key_binding.scroll_down, state, EMU_KEY_SCROLL_DOWN)
-  _TEST_KEY(g_key_binding.scroll_top, state, EMU_KEY_SCROLL_TOP)
-  _TEST_KEY(g_key_binding.scroll_center, state, EMU_KEY_SCROLL_CENTER)
-  _TEST_KEY(g_key_binding.scroll_bottom, state, EMU_KEY_SCROLL_BOTTOM)
-  _TEST_KEY(g_key_binding.sram_commit, state, EMU_KEY_SRAM_COMMIT)
+  _TEST_KEY(binding->quit, state, EMU_KEY_QUIT)
+  _TEST_KEY(binding->mute, state, EMU_KEY_MUTE)
+  _TEST_KEY(binding->reset_hard, state, EMU_KEY_RESET)
+  _TEST_KEY(binding->scroll_up, state, EMU_KEY_SCROLL_UP)
+  _TEST_KEY(binding->scroll_down, state, EMU_KEY_SCROLL_DOWN)
+  _TEST_KEY(binding->scroll_top, state, EMU_KEY_SCROLL_TOP)
+  _TEST_KEY(binding->scroll_center, state, EMU_KEY_SCROLL_CENTER)
+  _TEST_KEY(binding->scroll_bottom, state, EMU_KEY_SCROLL_BOTTOM)
+  _TEST_KEY(binding->sram_commit, state, EMU_KEY_SRAM_COMMIT)
 
   return state;
 }
 
-static uint8_t _map_pad_state(unsigned short key) {
+static uint8_t _map_pad_state(const struct key_binding_s * const binding, unsigned short key) {
   uint8_t state = 0;
 
   /* If reset button is pressed, press down A B Select Start and short circuit. */
-  if (g_key_binding.reset_combo != 0 && key == g_key_binding.reset_combo) {
+  if (binding->reset_combo != 0 && key == binding->reset_combo) {
     state = JOYPAD_A | JOYPAD_B | JOYPAD_SELECT | JOYPAD_START;
     return state;
   }
 
-  _TEST_KEY(g_key_binding.a, state, JOYPAD_A)
-  _TEST_KEY(g_key_binding.b, state, JOYPAD_B)
-  _TEST_KEY(g_key_binding.select, state, JOYPAD_SELECT)
-  _TEST_KEY(g_key_binding.start, state, JOYPAD_START)
-  _TEST_KEY(g_key_binding.up, state, JOYPAD_UP)
-  _TEST_KEY(g_key_binding.down, state, JOYPAD_DOWN)
-  _TEST_KEY(g_key_binding.left, state, JOYPAD_LEFT)
-  _TEST_KEY(g_key_binding.right, state, JOYPAD_RIGHT)
+  _TEST_KEY(binding->a, state, JOYPAD_A)
+  _TEST_KEY(binding->b, state, JOYPAD_B)
+  _TEST_KEY(binding->select, state, JOYPAD_SELECT)
+  _TEST_KEY(binding->start, state, JOYPAD_START)
+  _TEST_KEY(binding->up, state, JOYPAD_UP)
+  _TEST_KEY(binding->down, state, JOYPAD_DOWN)
+  _TEST_KEY(binding->left, state, JOYPAD_LEFT)
+  _TEST_KEY(binding->right, state, JOYPAD_RIGHT)
 
   return state;
 }
@@ -736,7 +1705,7 @@ static uint8_t _map_pad_state(unsigned short key) {
 #if PEANUT_FULL_GBC_SUPPORT
 static uint16_t *generate_cgb_table_rgb565(void) {
   const uint16_t colors = 32 * 32 * 32;
-  uint16_t *result = calloc(colors, sizeof(result));
+  uint16_t *result = calloc(colors, sizeof(*result));
   if (result == NULL) {
     return NULL;
   }
@@ -753,7 +1722,7 @@ static uint16_t *generate_cgb_table_rgb565(void) {
 
 static uint16_t *generate_cgb_table_bgr565(void) {
   const uint16_t colors = 32 * 32 * 32;
-  uint16_t *result = calloc(colors, sizeof(result));
+  uint16_t *result = calloc(colors, sizeof(*result));
   if (result == NULL) {
     return NULL;
   }
@@ -770,7 +1739,7 @@ static uint16_t *generate_cgb_table_bgr565(void) {
 
 static uint32_t *generate_cgb_table_xrgb(void) {
   const uint16_t colors = 32 * 32 * 32;
-  uint32_t *result = calloc(colors, sizeof(result));
+  uint32_t *result = calloc(colors, sizeof(*result));
   if (result == NULL) {
     return NULL;
   }
@@ -786,6 +1755,57 @@ static uint32_t *generate_cgb_table_xrgb(void) {
 }
 #endif
 
+/* Once the last visible line (end - 1) is reached, detach the line callback so the core skips rendering the rest of
+   the frame. loop() re-attaches it before the next frame. With the present worker, blitters run on the worker and
+   lcd_capture_line() does this instead.
+
+   This is not a documented Peanut-GB API. It relies on __gb_draw_line() returning right away, before any background,
+   window or sprite work, when gb->display.lcd_draw_line is NULL (the "LCD not initialised by front-end" check). LY,
+   STAT and the mode timing are advanced by __gb_step_cpu() independently of that. If the core ever drops the check,
+   this would crash on a NULL call instead of skipping.
+
+   Only lines after the window can be skipped this way. The callback is only invoked after a line has been rendered,
+   so lines above yskip are still rendered and then discarded by the blitters. */
+static inline void _skip_lines_after(struct gb_s *gb, const uint_fast8_t line, const unsigned int end) {
+  const struct priv_s * const priv = gb->direct.priv;
+  if (line + 1u >= end && !priv->present_thread) {
+    gb->display.lcd_draw_line = NULL;
+  }
+}
+
+/* Line callback used with the present worker. Only copies the raw line, conversion happens on the worker. */
+void lcd_capture_line(struct gb_s *gb, const uint8_t pixels[160], const uint_fast8_t line) {
+  const struct priv_s * const priv = gb->direct.priv;
+  struct present_frame_s * const frame = &priv->present.frames[priv->present.capture];
+
+  memcpy(frame->pixels[line], pixels, LCD_WIDTH);
+  frame->valid[line] = true;
+  /* No blitter draws past yskip + height. */
+  if (line + 1u >= (unsigned int) priv->yskip + priv->height) {
+    gb->display.lcd_draw_line = NULL;
+  }
+}
+
+/* Force every line to be blitted again the next time the core draws it. */
+static inline void _screen_invalidate(struct priv_screen_s *screen) {
+  memset(screen->stale, true, sizeof(screen->stale));
+}
+
+/* Line callback used with skip_static_lines. Lines are only passed on to the blitter if they differ from what was
+   last blitted on the same line. */
+void lcd_draw_line_if_changed(struct gb_s *gb, const uint8_t pixels[160], const uint_fast8_t line) {
+  struct priv_s * const priv = gb->direct.priv;
+  struct priv_screen_s * const screen = &priv->screen;
+
+  if (screen->stale[line] || memcmp(screen->lines[line], pixels, LCD_WIDTH) != 0) {
+    memcpy(screen->lines[line], pixels, LCD_WIDTH);
+    screen->stale[line] = false;
+    screen->changed = true;
+    priv->lcd_draw_line(gb, pixels, line);
+  }
+  _skip_lines_after(gb, line, (unsigned int) priv->yskip + priv->height);
+}
+
 void lcd_draw_line_safe(struct gb_s *gb, const uint8_t pixels[160], const uint_fast8_t line) {
   const struct priv_s * const priv = gb->direct.priv;
   lcd_surface_t *fb = priv->fb;
@@ -798,6 +1818,132 @@ void lcd_draw_line_safe(struct gb_s *gb, const uint8_t pixels[160], const uint_f
   }
 }
 
+/* Blend a complete fit-to-height group. c holds the shades of the third line. The output lines are padded with 2
+   zero shades so that the SA7101 blitters can always pack 3 pixels per write. */
+static inline void _fit_height_blend(const struct priv_fit_s * const fit, const uint8_t c[LCD_WIDTH], uint8_t out[2][LCD_WIDTH + 2]) {
+  for (size_t x = 0; x < LCD_WIDTH; x++) {
+    const uint8_t b = fit->lines[1][x];
+    out[0][x] = fit->blend[(fit->lines[0][x] << 4) | b];
+    out[1][x] = fit->blend[(c[x] << 4) | b];
+  }
+  out[0][LCD_WIDTH] = out[0][LCD_WIDTH + 1] = 0;
+  out[1][LCD_WIDTH] = out[1][LCD_WIDTH + 1] = 0;
+}
+
+#if PEANUT_FULL_GBC_SUPPORT
+/* Brightness of a CGB color on a 0 (black) to 15 (white) scale. */
+static inline uint8_t _cgb_shade(const uint16_t pixel) {
+  return (COLOR_MAP_CGB[pixel & 0x001f] * 18 + COLOR_MAP_CGB[(pixel & 0x03e0) >> 5] * 183 + COLOR_MAP_CGB[(pixel & 0x7c00) >> 10] * 54) >> 12;
+}
+#endif
+
+/* Fit-to-height variant of lcd_draw_line_fast_p4(). */
+static void _fit_height_p4(struct gb_s *gb, const uint8_t pixels[160], const uint_fast8_t line) {
+  struct priv_s * const priv = gb->direct.priv;
+  struct priv_fit_s * const fit = &priv->fit;
+  uint8_t *buffer = (uint8_t *) priv->fb->buffer;
+  uint8_t third[LCD_WIDTH];
+  uint8_t out[2][LCD_WIDTH + 2];
+
+  /* The first two lines of a group are only kept until the third one arrives. */
+  uint8_t *shades = (line % 3 < 2) ? fit->lines[line % 3] : third;
+#if PEANUT_FULL_GBC_SUPPORT
+  if (gb->cgb.cgbMode) {
+    for (size_t x = 0; x < LCD_WIDTH; x++) {
+      shades[x] = _cgb_shade(gb->cgb.fixPalette[pixels[x]]);
+    }
+  } else {
+#endif
+    for (size_t x = 0; x < LCD_WIDTH; x++) {
+      shades[x] = COLOR_MAP[pixels[x] & 3] & 0xf;
+    }
+#if PEANUT_FULL_GBC_SUPPORT
+  }
+#endif
+  if (shades != third) {
+    return;
+  }
+
+  _fit_height_blend(fit, third, out);
+  for (size_t i = 0; i < 2; i++) {
+    for (size_t x = 0; x < LCD_WIDTH; x += 2) {
+      buffer[x / 2] = (out[i][x] << 4) | out[i][x + 1];
+    }
+    _BitBlt(priv->real_fb, priv->canvas_x & 0xfffe, priv->canvas_y + line / 3 * 2 + i, LCD_WIDTH, 1, priv->fb, 0, 0, BLIT_NONE);
+  }
+}
+
+/* Collect the shades of a line for the SA7101 fit-to-height blitters, using the same 0-15 scale as the regular
+   SA7101 blitters (0 is white). Returns true once a group is complete and out holds the 2 output lines. */
+static bool _fit_height_sa7101_collect(struct gb_s *gb, const uint8_t pixels[160], const uint_fast8_t line, uint8_t out[2][LCD_WIDTH + 2]) {
+  struct priv_s * const priv = gb->direct.priv;
+  struct priv_fit_s * const fit = &priv->fit;
+  uint8_t third[LCD_WIDTH];
+
+  uint8_t *shades = (line % 3 < 2) ? fit->lines[line % 3] : third;
+#if PEANUT_FULL_GBC_SUPPORT
+  if (gb->cgb.cgbMode) {
+    for (size_t x = 0; x < LCD_WIDTH; x++) {
+      shades[x] = 15 - _cgb_shade(gb->cgb.fixPalette[pixels[x]]);
+    }
+  } else {
+#endif
+    for (size_t x = 0; x < LCD_WIDTH; x++) {
+      shades[x] = (pixels[x] & 3) * 5;
+    }
+#if PEANUT_FULL_GBC_SUPPORT
+  }
+#endif
+  if (shades != third) {
+    return false;
+  }
+  _fit_height_blend(fit, third, out);
+  return true;
+}
+
+/* Fit-to-height variant of lcd_draw_line_fast_p4_sa7101_t1(). Both output lines are written in one go. */
+static void _fit_height_sa7101_t1(struct gb_s *gb, const uint8_t pixels[160], const uint_fast8_t line) {
+  const struct priv_s * const priv = gb->direct.priv;
+  uint8_t out[2][LCD_WIDTH + 2];
+
+  if (!_fit_height_sa7101_collect(gb, pixels, line, out)) {
+    return;
+  }
+
+  for (size_t i = 0; i < 2; i++) {
+    const uint8_t *o = out[i];
+    *SA7101_LCD_CTRL = SA7101_LCD_CTRL_SET_CURSOR_P4;
+    *SA7101_LCD_DATA = ((priv->canvas_y + line / 3 * 2 + i) << 8) | (priv->canvas_x_triplet + 0x34);
+    *SA7101_LCD_CTRL = SA7101_LCD_CTRL_SET_PIXELS;
+    for (size_t x = 0; x < LCD_WIDTH; x += 3) {
+      *SA7101_LCD_DATA = (o[x] << 12) | (o[x + 1] << 7) | (o[x + 2] << 1);
+    }
+  }
+}
+
+/* Fit-to-height variant of lcd_draw_line_fast_p4_sa7101_t2(). Both output lines are written in one go. */
+static void _fit_height_sa7101_t2(struct gb_s *gb, const uint8_t pixels[160], const uint_fast8_t line) {
+  const struct priv_s * const priv = gb->direct.priv;
+  uint8_t out[2][LCD_WIDTH + 2];
+
+  if (!_fit_height_sa7101_collect(gb, pixels, line, out)) {
+    return;
+  }
+
+  const unsigned short lcd_xoff = priv->canvas_x_triplet + 0x18;
+  for (size_t i = 0; i < 2; i++) {
+    const uint8_t *o = out[i];
+    const unsigned short y = priv->canvas_y + line / 3 * 2 + i;
+    *SA7101_LCD_CTRL = SA7101_LCD_CTRL_SET_CURSOR_P4_X_UPPER | (lcd_xoff >> 4);
+    *SA7101_LCD_CTRL = SA7101_LCD_CTRL_SET_CURSOR_P4_X_LOWER | (lcd_xoff & 0xf);
+    *SA7101_LCD_CTRL = SA7101_LCD_CTRL_SET_CURSOR_P4_Y_UPPER | (y >> 4);
+    *SA7101_LCD_CTRL = SA7101_LCD_CTRL_SET_CURSOR_P4_Y_LOWER | (y & 0xf);
+    for (size_t x = 0; x < LCD_WIDTH; x += 3) {
+      *SA7101_LCD_DATA = o[x] | (o[x + 1] << 4) | (o[x + 2] << 8);
+    }
+  }
+}
+
 void lcd_draw_line_fast_p4(struct gb_s *gb, const uint8_t pixels[160], const uint_fast8_t line) {
   const struct priv_s * const priv = gb->direct.priv;
   lcd_surface_t *fb = priv->fb;
@@ -805,6 +1951,11 @@ void lcd_draw_line_fast_p4(struct gb_s *gb, const uint8_t pixels[160], const uin
   if (line >= priv->height + priv->yskip || line < priv->yskip) {
     return;
   }
+  _skip_lines_after(gb, line, priv->yskip + priv->height);
+  if (priv->fit_height) {
+    _fit_height_p4(gb, pixels, line);
+    return;
+  }
 
   ((uint8_t *) fb->buffer)[0] = 0xff;
 
@@ -867,6 +2018,11 @@ void lcd_draw_line_fast_p4_sa7101_t1(struct gb_s *gb, const uint8_t pixels[160],
   if (line >= priv->height + priv->yskip || line < priv->yskip) {
     return;
   }
+  _skip_lines_after(gb, line, priv->yskip + priv->height);
+  if (priv->fit_height) {
+    _fit_height_sa7101_t1(gb, pixels, line);
+    return;
+  }
 
   *SA7101_LCD_CTRL = SA7101_LCD_CTRL_SET_CURSOR_P4;
   *SA7101_LCD_DATA = ((priv->canvas_y + line) << 8) | (priv->canvas_x_triplet + 0x34);
@@ -915,6 +2071,11 @@ void lcd_draw_line_fast_p4_sa7101_t2(struct gb_s *gb, const uint8_t pixels[160],
   if (line >= priv->height + priv->yskip || line < priv->yskip) {
     return;
   }
+  _skip_lines_after(gb, line, priv->yskip + priv->height);
+  if (priv->fit_height) {
+    _fit_height_sa7101_t2(gb, pixels, line);
+    return;
+  }
 
   unsigned short lcd_xoff = priv->canvas_x_triplet + 0x18;
   *SA7101_LCD_CTRL = SA7101_LCD_CTRL_SET_CURSOR_P4_X_UPPER | (lcd_xoff >> 4);
@@ -960,31 +2121,105 @@ void lcd_draw_line_fast_p4_sa7101_t2(struct gb_s *gb, const uint8_t pixels[160],
 
 void lcd_draw_line_fast_xrgb(struct gb_s *gb, const uint8_t pixels[160], const uint_fast8_t line) {
   const struct priv_s * const priv = gb->direct.priv;
-  lcd_surface_t *fb = priv->fb;
 
   if (line >= priv->height) {
     return;
   }
+  _skip_lines_after(gb, line, priv->height);
 
-  for (size_t x = 0; x < LCD_WIDTH; x++) {
-    if (x >= priv->width) {
-      break;
+  /* Keep the mode check and bounds out of the per-pixel loop, and walk the line with a plain pointer. */
+  uint32_t *dst = &((uint32_t *) priv->fb->buffer)[priv->surface_yoff[line]];
+  const size_t width = (priv->width < LCD_WIDTH) ? priv->width : LCD_WIDTH;
+
+#if PEANUT_FULL_GBC_SUPPORT
+  if (gb->cgb.cgbMode) {
+    const uint16_t *palette = gb->cgb.fixPalette;
+    for (size_t x = 0; x < width; x++) {
+      dst[x] = priv->color_map_cgb_32[palette[pixels[x]]];
     }
+    return;
+  }
+#endif
 
-    size_t pixel_offset = priv->surface_yoff[line] + x;
+  /* TODO palette */
+  for (size_t x = 0; x < width; x++) {
+    dst[x] = COLOR_MAP_32[pixels[x] & 3];
+  }
+}
 
+/* Convert one source line and write it to dst scaled by the column map. Each source pixel is converted once and
+   written to all destination columns it covers. 2x and 3x have unrolled stores, other factors walk the map. */
+#define _SCALE_LINE(type, dst, scale, width, convert) do { \
+  type *_out = (dst); \
+  switch ((scale)->factor) { \
+  case 2: \
+    for (size_t x = 0; x < (width); x++) { \
+      const type _c = convert(pixels[x]); \
+      _out[0] = _c; \
+      _out[1] = _c; \
+      _out += 2; \
+    } \
+    break; \
+  case 3: \
+    for (size_t x = 0; x < (width); x++) { \
+      const type _c = convert(pixels[x]); \
+      _out[0] = _c; \
+      _out[1] = _c; \
+      _out[2] = _c; \
+      _out += 3; \
+    } \
+    break; \
+  default: \
+    for (size_t x = 0; x < (width); x++) { \
+      const type _c = convert(pixels[x]); \
+      for (size_t dx = (scale)->col_start[x]; dx < (scale)->col_start[x + 1]; dx++) { \
+        (dst)[dx] = _c; \
+      } \
+    } \
+    break; \
+  } \
+} while (0)
+
+/* Repeat the destination row just written for the remaining rows covered by the source line. */
+#define _SCALE_ROWS(type, dst, scale, line, width) do { \
+  const size_t _rows = (scale)->row_start[(line) + 1] - (scale)->row_start[(line)]; \
+  const size_t _bytes = (scale)->col_start[(width)] * sizeof(type); \
+  for (size_t r = 1; r < _rows; r++) { \
+    memcpy((dst) + r * (scale)->stride, (dst), _bytes); \
+  } \
+} while (0)
+
+#define _CONVERT_XRGB(p) (COLOR_MAP_32[(p) & 3])
+#define _CONVERT_RGB565(p) (COLOR_MAP_16[(p) & 3])
 #if PEANUT_FULL_GBC_SUPPORT
-    if (gb->cgb.cgbMode) {
-      uint16_t pixel = gb->cgb.fixPalette[pixels[x]];
-      ((uint32_t *) fb->buffer)[pixel_offset] = color_map_cgb_32[pixel];
-    } else {
+#define _CONVERT_XRGB_CGB(p) (priv->color_map_cgb_32[palette[(p)]])
+#define _CONVERT_RGB565_CGB(p) (priv->color_map_cgb_16[palette[(p)]])
 #endif
-      /* TODO palette */
-      ((uint32_t *) fb->buffer)[pixel_offset] = COLOR_MAP_32[pixels[x] & 3];
+
+void lcd_draw_line_fast_xrgb_scaled(struct gb_s *gb, const uint8_t pixels[160], const uint_fast8_t line) {
+  const struct priv_s * const priv = gb->direct.priv;
+  const struct priv_scale_s * const scale = &priv->scale;
+
+  if (line >= priv->height) {
+    return;
+  }
+  _skip_lines_after(gb, line, priv->height);
+
+  uint32_t *dst = &((uint32_t *) priv->fb->buffer)[priv->surface_yoff[line]];
+  const size_t width = priv->width;
+
 #if PEANUT_FULL_GBC_SUPPORT
-    }
-#endif
+  if (gb->cgb.cgbMode) {
+    const uint16_t *palette = gb->cgb.fixPalette;
+    _SCALE_LINE(uint32_t, dst, scale, width, _CONVERT_XRGB_CGB);
+    _SCALE_ROWS(uint32_t, dst, scale, line, width);
+    return;
   }
+#endif
+
+  /* TODO palette */
+  _SCALE_LINE(uint32_t, dst, scale, width, _CONVERT_XRGB);
+  _SCALE_ROWS(uint32_t, dst, scale, line, width);
 }
 
 void lcd_draw_line_fast_xrgb_rot(struct gb_s *gb, const uint8_t pixels[160], const uint_fast8_t line) {
@@ -994,6 +2229,7 @@ void lcd_draw_line_fast_xrgb_rot(struct gb_s *gb, const uint8_t pixels[160], con
   if (line >= priv->height) {
     return;
   }
+  _skip_lines_after(gb, line, priv->height);
 
   for (size_t x = 0; x < LCD_WIDTH; x++) {
     if (x >= priv->width) {
@@ -1021,7 +2257,7 @@ void lcd_draw_line_fast_xrgb_rot(struct gb_s *gb, const uint8_t pixels[160], con
 #if PEANUT_FULL_GBC_SUPPORT
     if (gb->cgb.cgbMode) {
       uint16_t pixel = gb->cgb.fixPalette[pixels[x]];
-      ((uint32_t *) fb->buffer)[pixel_offset] = color_map_cgb_32[pixel];
+      ((uint32_t *) fb->buffer)[pixel_offset] = priv->color_map_cgb_32[pixel];
     } else {
 #endif
       /* TODO palette */
@@ -1034,31 +2270,55 @@ void lcd_draw_line_fast_xrgb_rot(struct gb_s *gb, const uint8_t pixels[160], con
 
 void lcd_draw_line_fast_rgb565(struct gb_s *gb, const uint8_t pixels[160], const uint_fast8_t line) {
   const struct priv_s * const priv = gb->direct.priv;
-  lcd_surface_t *fb = priv->fb;
 
   if (line >= priv->height) {
     return;
   }
+  _skip_lines_after(gb, line, priv->height);
 
-  for (size_t x = 0; x < LCD_WIDTH; x++) {
-    if (x >= priv->width) {
-      break;
-    }
-
-    size_t pixel_offset = priv->surface_yoff[line] + x;
+  uint16_t *dst = &((uint16_t *) priv->fb->buffer)[priv->surface_yoff[line]];
+  const size_t width = (priv->width < LCD_WIDTH) ? priv->width : LCD_WIDTH;
 
 #if PEANUT_FULL_GBC_SUPPORT
-    if (gb->cgb.cgbMode) {
-      uint16_t pixel = gb->cgb.fixPalette[pixels[x]];
-      ((uint16_t *) fb->buffer)[pixel_offset] = color_map_cgb_16[pixel];
-    } else {
-#endif
-      /* TODO palette */
-      ((uint16_t *) fb->buffer)[pixel_offset] = COLOR_MAP_16[pixels[x] & 3];
-#if PEANUT_FULL_GBC_SUPPORT
+  if (gb->cgb.cgbMode) {
+    const uint16_t *palette = gb->cgb.fixPalette;
+    for (size_t x = 0; x < width; x++) {
+      dst[x] = priv->color_map_cgb_16[palette[pixels[x]]];
     }
+    return;
+  }
 #endif
+
+  /* TODO palette */
+  for (size_t x = 0; x < width; x++) {
+    dst[x] = COLOR_MAP_16[pixels[x] & 3];
+  }
+}
+
+void lcd_draw_line_fast_rgb565_scaled(struct gb_s *gb, const uint8_t pixels[160], const uint_fast8_t line) {
+  const struct priv_s * const priv = gb->direct.priv;
+  const struct priv_scale_s * const scale = &priv->scale;
+
+  if (line >= priv->height) {
+    return;
+  }
+  _skip_lines_after(gb, line, priv->height);
+
+  uint16_t *dst = &((uint16_t *) priv->fb->buffer)[priv->surface_yoff[line]];
+  const size_t width = priv->width;
+
+#if PEANUT_FULL_GBC_SUPPORT
+  if (gb->cgb.cgbMode) {
+    const uint16_t *palette = gb->cgb.fixPalette;
+    _SCALE_LINE(uint16_t, dst, scale, width, _CONVERT_RGB565_CGB);
+    _SCALE_ROWS(uint16_t, dst, scale, line, width);
+    return;
   }
+#endif
+
+  /* TODO palette */
+  _SCALE_LINE(uint16_t, dst, scale, width, _CONVERT_RGB565);
+  _SCALE_ROWS(uint16_t, dst, scale, line, width);
 }
 
 void lcd_draw_line_fast_rgb565_sa7101(struct gb_s *gb, const uint8_t pixels[160], const uint_fast8_t line) {
@@ -1067,6 +2327,7 @@ void lcd_draw_line_fast_rgb565_sa7101(struct gb_s *gb, const uint8_t pixels[160]
   if (line >= priv->height) {
     return;
   }
+  _skip_lines_after(gb, line, priv->height);
 
   *SA7101_LCD_DATA;
   *SA7101_LCD_CTRL = SA7101_LCD_CTRL_SET_CURSOR_Y;
@@ -1076,37 +2337,39 @@ void lcd_draw_line_fast_rgb565_sa7101(struct gb_s *gb, const uint8_t pixels[160]
   *SA7101_LCD_CTRL = SA7101_LCD_CTRL_SET_PIXELS;
   *SA7101_LCD_DATA;
 
-  for (size_t x = 0; x < LCD_WIDTH; x++) {
-    if (x >= priv->width) {
-      break;
-    }
+  const size_t width = (priv->width < LCD_WIDTH) ? priv->width : LCD_WIDTH;
 
 #if PEANUT_FULL_GBC_SUPPORT
-    if (gb->cgb.cgbMode) {
-      uint16_t pixel = gb->cgb.fixPalette[pixels[x]];
-      *SA7101_LCD_DATA = color_map_cgb_16[pixel];
-    } else {
-#endif
-      /* TODO palette */
-      *SA7101_LCD_DATA = COLOR_MAP_16_BGR565[pixels[x] & 3];
-#if PEANUT_FULL_GBC_SUPPORT
+  if (gb->cgb.cgbMode) {
+    const uint16_t *palette = gb->cgb.fixPalette;
+    for (size_t x = 0; x < width; x++) {
+      *SA7101_LCD_DATA = priv->color_map_cgb_16[palette[pixels[x]]];
     }
+    return;
+  }
 #endif
+
+  /* TODO palette */
+  for (size_t x = 0; x < width; x++) {
+    *SA7101_LCD_DATA = COLOR_MAP_16_BGR565[pixels[x] & 3];
   }
 }
 
 uint8_t gb_rom_read(struct gb_s *gb, const uint_fast32_t addr) {
   const struct priv_s * const priv = gb->direct.priv;
+  PROFILE_COUNT(g_profile.rom_read[(addr >> 14) % PROFILE_ROM_BANKS]);
   return priv->rom[addr];
 }
 
 uint8_t gb_cart_ram_read(struct gb_s *gb, const uint_fast32_t addr) {
   const struct priv_s * const priv = gb->direct.priv;
+  PROFILE_COUNT(g_profile.cart_ram_read[(addr >> 13) % PROFILE_CART_RAM_BANKS]);
   return priv->cart_ram[addr];
 }
 
 void gb_cart_ram_write(struct gb_s *gb, const uint_fast32_t addr, const uint8_t val) {
   const struct priv_s * const priv = gb->direct.priv;
+  PROFILE_COUNT(g_profile.cart_ram_write[(addr >> 13) % PROFILE_CART_RAM_BANKS]);
   priv->cart_ram[addr] = val;
 }
 
@@ -1115,6 +2378,104 @@ uint8_t gb_bootrom_read(struct gb_s *gb, const uint_fast16_t addr) {
   return priv->boot_rom[addr];
 }
 
+/* Start recording to or playing back from the movie file next to the ROM. Returns false if the movie file cannot be
+   used, in which case the emulator runs with live input. */
+static bool _movie_begin(struct gb_s *gb) {
+  struct priv_s *priv = gb->direct.priv;
+  struct priv_movie_s *movie = &priv->movie;
+  struct input_movie_header_s header = {0};
+  struct tm timeinfo = {0};
+
+  memset(movie, 0, sizeof(*movie));
+  if (priv->config.debug_input_movie == INPUT_MOVIE_RECORD) {
+    time_t rawtime;
+    time(&rawtime);
+    localtime_r(&rawtime, &timeinfo);
+
+    movie->file = fopen(priv->movie_file_name, "wb");
+    if (movie->file == NULL) {
+      return false;
+    }
+    header.magic = INPUT_MOVIE_MAGIC;
+    header.rtc_sec = timeinfo.tm_sec;
+    header.rtc_min = timeinfo.tm_min;
+    header.rtc_hour = timeinfo.tm_hour;
+    header.rtc_yday = timeinfo.tm_yday;
+    if (fwrite(&header, sizeof(header), 1, movie->file) != 1) {
+      fclose(movie->file);
+      movie->file = NULL;
+      return false;
+    }
+  } else if (priv->config.debug_input_movie == INPUT_MOVIE_PLAY) {
+    movie->file = fopen(priv->movie_file_name, "rb");
+    if (movie->file == NULL) {
+      return false;
+    }
+    if (fread(&header, sizeof(header), 1, movie->file) != 1 || header.magic != INPUT_MOVIE_MAGIC) {
+      fclose(movie->file);
+      movie->file = NULL;
+      return false;
+    }
+    timeinfo.tm_sec = header.rtc_sec;
+    timeinfo.tm_min = header.rtc_min;
+    timeinfo.tm_hour = header.rtc_hour;
+    timeinfo.tm_yday = header.rtc_yday;
+  } else {
+    return true;
+  }
+
+  gb_set_rtc(gb, &timeinfo);
+  /* Resyncing to the wall clock would make playback diverge. */
+  priv->config.sync_rtc_on_resume = false;
+  movie->mode = priv->config.debug_input_movie;
+  return true;
+}
+
+/* Record or play back one frame worth of input. In playback mode, joypad and reset are overwritten with the movie
+   contents. Once the movie runs out, live input takes over. */
+static void _movie_frame(struct priv_s *priv, uint8_t *joypad, bool *reset) {
+  struct priv_movie_s *movie = &priv->movie;
+  uint8_t flags = *reset ? INPUT_MOVIE_FLAG_RESET : 0;
+
+  if (movie->mode == INPUT_MOVIE_RECORD) {
+    if (movie->run.frames != 0 && movie->run.joypad == *joypad && movie->run.flags == flags &&
+        movie->run.frames < UINT16_MAX) {
+      movie->run.frames++;
+      return;
+    }
+    if (movie->run.frames != 0) {
+      fwrite(&movie->run, sizeof(movie->run), 1, movie->file);
+    }
+    movie->run.frames = 1;
+    movie->run.joypad = *joypad;
+    movie->run.flags = flags;
+  } else if (movie->mode == INPUT_MOVIE_PLAY) {
+    while (movie->run.frames == 0) {
+      if (fread(&movie->run, sizeof(movie->run), 1, movie->file) != 1) {
+        fclose(movie->file);
+        movie->file = NULL;
+        movie->mode = INPUT_MOVIE_OFF;
+        return;
+      }
+    }
+    *joypad = movie->run.joypad;
+    *reset = !!(movie->run.flags & INPUT_MOVIE_FLAG_RESET);
+    movie->run.frames--;
+  }
+}
+
+static void _movie_end(struct priv_s *priv) {
+  struct priv_movie_s *movie = &priv->movie;
+
+  if (movie->file != NULL) {
+    if (movie->mode == INPUT_MOVIE_RECORD && movie->run.frames != 0) {
+      fwrite(&movie->run, sizeof(movie->run), 1, movie->file);
+    }
+    fclose(movie->file);
+    movie->file = NULL;
+  }
+}
+
 void gb_error(struct gb_s *gb, const enum gb_error_e gb_err, const uint16_t addr) {
   const char *gb_err_str[GB_INVALID_MAX] = {
     "UNKNOWN",
@@ -1130,10 +2491,12 @@ void gb_error(struct gb_s *gb, const enum gb_error_e gb_err, const uint16_t addr
 
   /* Record save file. */
   _write_save(gb, "recovery.sav");
+  _movie_end(gb->direct.priv);
 
   /* Stop workers (if they are running). */
   mutekix_time_fini();
   _sound_off(gb);
+  _present_end(gb);
 
   if(addr >= 0x4000 && addr < 0x8000)
   {
@@ -1167,6 +2530,27 @@ static void _set_rtc(struct gb_s *gb) {
   gb_set_rtc(gb, &timeinfo);
 }
 
+/* Derive a file name from the ROM file name. dst must have room for the ROM file name plus the suffix. */
+static void _replace_extension(char *dst, const char *rom_file_name, const char *suffix) {
+  /* Copy the ROM file name to allocated space. */
+  strcpy(dst, rom_file_name);
+
+  char *str_replace;
+
+  /* If the file name does not have a dot, or the only dot is at
+   * the start of the file name, set the pointer to begin
+   * replacing the string to the end of the file name, otherwise
+   * set it to the dot. */
+  if ((str_replace = strrchr(dst, '.')) == NULL || str_replace == dst) {
+    str_replace = dst + strlen(dst);
+  }
+
+  /* Copy extension to string including terminating null byte. */
+  for (unsigned int i = 0; i <= strlen(suffix); i++) {
+    *(str_replace++) = suffix[i];
+  }
+}
+
 static int rom_file_picker(struct priv_s * const priv) {
   UTF16 utf16path[FILEPICKER_CONTEXT_OUTPUT_MAX_LFN] = {0};
 
@@ -1196,29 +2580,79 @@ static int rom_file_picker(struct priv_s * const priv) {
     return 1;
   }
 
-  free(ctx_out);
+  free(ctx_out);
+
+  if (wcstombs(priv->rom_file_name, utf16path, sizeof(priv->rom_file_name)) == (size_t) -1) {
+    return 2;
+  };
+
+  _replace_extension(priv->save_file_name, priv->rom_file_name, SAVE_FILE_SUFFIX);
+  _replace_extension(priv->movie_file_name, priv->rom_file_name, MOVIE_FILE_SUFFIX);
+
+  return 0;
+}
+
+/* Read and parse only the cartridge header part of a ROM file. */
+static bool _read_rom_header(const char *path, struct rom_header_s *header) {
+  uint8_t raw[ROM_HEADER_SIZE];
+  uint8_t checksum = 0;
+
+  FILE *f = fopen(path, "rb");
+  if (f == NULL) {
+    return false;
+  }
+  if (fseek(f, ROM_HEADER_OFFSET, SEEK_SET) != 0 || fread(raw, 1, sizeof(raw), f) != sizeof(raw)) {
+    fclose(f);
+    return false;
+  }
+  fclose(f);
+
+  header->cgb_flag = raw[0x143 - ROM_HEADER_OFFSET];
+  header->cart_type = raw[0x147 - ROM_HEADER_OFFSET];
+  for (size_t i = 0; i < 0x14d - ROM_HEADER_OFFSET; i++) {
+    checksum = checksum - raw[i] - 1;
+  }
+  header->checksum_ok = (checksum == raw[0x14d - ROM_HEADER_OFFSET]);
+  return true;
+}
 
-  if (wcstombs(priv->rom_file_name, utf16path, sizeof(priv->rom_file_name)) == (size_t) -1) {
-    return 2;
-  };
+static int rom_precheck(struct priv_s * const priv) {
+  struct rom_header_s header;
 
-  /* Copy the ROM file name to allocated space. */
-  strcpy(priv->save_file_name, priv->rom_file_name);
+  /* If the header can't be read, leave the error reporting to the actual loading process. */
+  if (!_read_rom_header(priv->rom_file_name, &header)) {
+    return 0;
+  }
 
-  char *str_replace;
+  if (!header.checksum_ok) {
+    MessageBox(_BUL("Invalid ROM: Checksum failure."), MB_DEFAULT);
+    return 2;
+  }
 
-  /* If the file name does not have a dot, or the only dot is at
-   * the start of the file name, set the pointer to begin
-   * replacing the string to the end of the file name, otherwise
-   * set it to the dot. */
-  if ((str_replace = strrchr(priv->save_file_name, '.')) == NULL || str_replace == priv->save_file_name) {
-    str_replace = priv->save_file_name + strlen(priv->save_file_name);
+  /* Only a warning. gb_init() rejects the cartridge with GB_INIT_CARTRIDGE_UNSUPPORTED if it really can't be
+     emulated. */
+  if (header.cart_type >= sizeof(CART_MBC) || CART_MBC[header.cart_type] == 0xff) {
+    int ret = messagebox_format(
+      MB_ICON_WARNING | MB_BUTTON_YES | MB_BUTTON_NO,
+      "Cartridge type 0x%02X is probably not supported. Load anyway?",
+      header.cart_type
+    );
+    if (ret != MB_RESULT_YES) {
+      return 1;
+    }
   }
 
-  /* Copy extension to string including terminating null byte. */
-  for (unsigned int i = 0; i <= strlen(SAVE_FILE_SUFFIX); i++) {
-    *(str_replace++) = SAVE_FILE_SUFFIX[i];
+#if !PEANUT_FULL_GBC_SUPPORT
+  if (header.cgb_flag == 0xc0) {
+    unsigned int ret = MessageBox(
+      _BUL("This ROM requires Game Boy Color. Use WoodyBoy Color instead. Load anyway?"),
+      MB_ICON_WARNING | MB_BUTTON_YES | MB_BUTTON_NO
+    );
+    if (ret != MB_RESULT_YES) {
+      return 1;
+    }
   }
+#endif
 
   return 0;
 }
@@ -1243,6 +2677,244 @@ static inline void sleep_with_double_rtc(unsigned short ms) {
   }
 }
 
+static void _write_timing_cache(const struct timing_calibration_s *cal) {
+  FILE *f = fopen(TIMING_CACHE_PATH, "wb");
+  if (f != NULL) {
+    fwrite(cal, sizeof(*cal), 1, f);
+    fclose(f);
+  }
+}
+
+static void _measure_timing(struct timing_calibration_s *cal) {
+  datetime_t dt;
+
+  /* Start right after a tick so the first probe isn't cut short. */
+  OSSleep(1);
+  unsigned long long start = mutekix_time_get_usecs();
+  for (int i = 0; i < TIMING_PROBE_ROUNDS; i++) {
+    OSSleep(TIMING_PROBE_MS);
+  }
+  cal->sleep_usecs = (mutekix_time_get_usecs() - start) / TIMING_PROBE_ROUNDS;
+
+  /* Busy-poll the RTC. A real millisecond RTC changes on almost every millisecond. */
+  GetSysTime(&dt);
+  int last_millis = dt.millis;
+  cal->rtc_millis_steps = 0;
+  start = mutekix_time_get_usecs();
+  while (mutekix_time_get_usecs() - start < TIMING_RTC_PROBE_USECS) {
+    GetSysTime(&dt);
+    if (dt.millis != last_millis) {
+      cal->rtc_millis_steps++;
+      last_millis = dt.millis;
+    }
+  }
+}
+
+/* Select the frame pacing method. Without AutoTiming, this is the fixed quantum-based choice. Otherwise the board is
+   measured (or the cached measurement is loaded) and OSSleep() is scaled to match the measured sleep length. The
+   double-rate RTC sleep is only used if the RTC was seen to advance in milliseconds, since it spins on it. */
+static void _calibrate_timing(struct gb_s *gb, const lcd_t *lcd) {
+  struct priv_s *priv = gb->direct.priv;
+  struct timing_calibration_s cal = {0}, cached = {0};
+
+  priv->timing.rtc_sleep = (mutekix_time_get_quantum() == 500);
+  priv->timing.sleep_scale = 0x100;
+  if (!priv->config.auto_timing) {
+    return;
+  }
+
+  cal.magic = TIMING_CACHE_MAGIC;
+  cal.lcd_width = lcd->width;
+  cal.lcd_height = lcd->height;
+  cal.lcd_depth = lcd->surface->depth;
+  cal.quantum = mutekix_time_get_quantum();
+
+  FILE *f = fopen(TIMING_CACHE_PATH, "rb");
+  bool hit = false;
+  if (f != NULL) {
+    hit = (
+      fread(&cached, sizeof(cached), 1, f) == 1 &&
+      cached.magic == cal.magic &&
+      cached.lcd_width == cal.lcd_width &&
+      cached.lcd_height == cal.lcd_height &&
+      cached.lcd_depth == cal.lcd_depth &&
+      cached.quantum == cal.quantum
+    );
+    fclose(f);
+  }
+  if (hit) {
+    cal = cached;
+  } else {
+    _measure_timing(&cal);
+    _write_timing_cache(&cal);
+  }
+
+  priv->timing.rtc_sleep = priv->timing.rtc_sleep && cal.rtc_millis_steps >= TIMING_RTC_PROBE_USECS / 2000;
+  if (!priv->timing.rtc_sleep && cal.sleep_usecs != 0) {
+    unsigned long scale = (TIMING_PROBE_MS * 1000ul * 0x100) / cal.sleep_usecs;
+    /* Don't trust anything further off than 4x. */
+    if (scale < 0x40) {
+      scale = 0x40;
+    } else if (scale > 0x400) {
+      scale = 0x400;
+    }
+    priv->timing.sleep_scale = scale;
+  }
+
+  /* The key hold stall can only be measured while playing. It is only compensated for with OSSleep(), since the RTC
+     that sleep_with_double_rtc() waits on doesn't stall. */
+  priv->timing.cal = cal;
+  if (!priv->timing.rtc_sleep) {
+    priv->timing.hold_scale = cal.hold_scale;
+    priv->timing.hold_probe.active = (cal.hold_scale == 0);
+    priv->timing.hold_probe.last_second = (time_t) -1;
+  }
+}
+
+/* Called once per frame while the hold probe is active. The RTC has no usable millisecond resolution on most boards,
+   but its seconds are not affected by the stall. Each whole second is timed with the scheduler clock and counted as
+   held if a key was held through all of it, or as released if none was. Seconds that were skipped (dialogs, deep
+   sleep) are discarded. */
+static void _probe_hold_stall(struct priv_s *priv) {
+  struct priv_timing_s * const timing = &priv->timing;
+  struct timing_hold_probe_s * const probe = &timing->hold_probe;
+  const bool holding = priv->input.holding_any_key;
+
+  probe->held_all = probe->held_all && holding;
+  probe->released_all = probe->released_all && !holding;
+
+  time_t now = time(NULL);
+  if (now == probe->last_second) {
+    return;
+  }
+  unsigned long long now_usecs = mutekix_time_get_usecs();
+  if (probe->last_second != (time_t) -1 && now == probe->last_second + 1) {
+    if (probe->held_all) {
+      probe->held_secs++;
+      probe->held_usecs += now_usecs - probe->last_usecs;
+    } else if (probe->released_all) {
+      probe->released_secs++;
+      probe->released_usecs += now_usecs - probe->last_usecs;
+    }
+  }
+  probe->last_second = now;
+  probe->last_usecs = now_usecs;
+  probe->held_all = holding;
+  probe->released_all = !holding;
+
+  if (probe->held_secs < TIMING_HOLD_PROBE_SECS || probe->released_secs < TIMING_HOLD_PROBE_SECS) {
+    return;
+  }
+  unsigned long long held = probe->held_usecs / probe->held_secs;
+  unsigned long long released = probe->released_usecs / probe->released_secs;
+  unsigned long scale = (released != 0) ? held * 0x100 / released : 0x100;
+  /* The stall only ever slows the clock down. Don't trust anything further off than 4x. */
+  if (scale > 0x100) {
+    scale = 0x100;
+  } else if (scale < 0x40) {
+    scale = 0x40;
+  }
+  timing->hold_scale = scale;
+  timing->cal.hold_scale = scale;
+  probe->active = false;
+  _write_timing_cache(&timing->cal);
+}
+
+static size_t _memory_total(const struct priv_s * const priv) {
+  return (
+    priv->mem.rom + priv->mem.cart_ram + priv->mem.boot_rom + priv->mem.cgb_table +
+    priv->mem.audio_buffer + priv->mem.worker_stacks + priv->mem.framebuffer
+  );
+}
+
+static void _write_memory_report(struct gb_s *gb) {
+  struct priv_s *priv = gb->direct.priv;
+
+  priv->mem.worker_stacks = (
+    (priv->dis_active ? 1 : 0) + ((priv->sound_on || priv->sound_parked) ? 1 : 0) + (priv->present_thread ? 1 : 0)
+  ) * WORKER_STACK_SIZE;
+
+  FILE *f = fopen(MEMORY_LOG_PATH, "w");
+  if (f == NULL) {
+    return;
+  }
+  fprintf(f, "ROM: %u\r\n", (unsigned int) priv->mem.rom);
+  fprintf(f, "Cart RAM: %u\r\n", (unsigned int) priv->mem.cart_ram);
+  fprintf(f, "Boot ROM: %u\r\n", (unsigned int) priv->mem.boot_rom);
+  fprintf(f, "CGB color table: %u\r\n", (unsigned int) priv->mem.cgb_table);
+  fprintf(f, "Audio buffer: %u\r\n", (unsigned int) priv->mem.audio_buffer);
+  fprintf(f, "Worker stacks: %u\r\n", (unsigned int) priv->mem.worker_stacks);
+  fprintf(f, "Framebuffer: %u\r\n", (unsigned int) priv->mem.framebuffer);
+  fprintf(f, "Total: %u\r\n", (unsigned int) _memory_total(priv));
+  fprintf(f, "Low memory mode: %s\r\n", priv->low_memory ? "yes" : "no");
+  fclose(f);
+}
+
+#if WB_PROFILE
+static int _profile_entry_compare(const void *a, const void *b) {
+  const struct profile_entry_s *ea = a, *eb = b;
+  if (ea->count == eb->count) {
+    return 0;
+  }
+  return (ea->count < eb->count) ? 1 : -1;
+}
+
+static size_t _profile_add(
+  struct profile_entry_s *entries,
+  size_t nentries,
+  const unsigned long long *counters,
+  size_t ncounters,
+  const char *fmt,
+  unsigned int base
+) {
+  for (size_t i = 0; i < ncounters; i++) {
+    if (counters[i] != 0) {
+      sniprintf(entries[nentries].name, sizeof(entries[nentries].name), fmt, (unsigned int) i + base);
+      entries[nentries].count = counters[i];
+      nentries++;
+    }
+  }
+  return nentries;
+}
+
+/* Write all non-zero counters, busiest first, to PROFILE_PATH. */
+static void _write_profile_report(void) {
+  const size_t max_entries = PROFILE_ROM_BANKS + PROFILE_CART_RAM_BANKS * 2 + PROFILE_APU_REGS * 2;
+  struct profile_entry_s *entries = calloc(max_entries, sizeof(*entries));
+  if (entries == NULL) {
+    return;
+  }
+
+  size_t nentries = 0;
+  nentries = _profile_add(entries, nentries, g_profile.rom_read, PROFILE_ROM_BANKS, "ROM bank %u read", 0);
+  nentries = _profile_add(
+    entries, nentries, g_profile.cart_ram_read, PROFILE_CART_RAM_BANKS, "Cart RAM bank %u read", 0
+  );
+  nentries = _profile_add(
+    entries, nentries, g_profile.cart_ram_write, PROFILE_CART_RAM_BANKS, "Cart RAM bank %u write", 0
+  );
+  nentries = _profile_add(entries, nentries, g_profile.apu_read, PROFILE_APU_REGS, "IO %04X read", 0xff10);
+  nentries = _profile_add(entries, nentries, g_profile.apu_write, PROFILE_APU_REGS, "IO %04X write", 0xff10);
+  qsort(entries, nentries, sizeof(*entries), &_profile_entry_compare);
+
+  FILE *f = fopen(PROFILE_PATH, "w");
+  if (f != NULL) {
+    fprintf(f, "Frames: %llu\r\n", g_profile.frames);
+    for (size_t i = 0; i < nentries; i++) {
+      fprintf(
+        f,
+        "%-24s %12llu %10llu/frame\r\n",
+        entries[i].name,
+        entries[i].count,
+        (g_profile.frames != 0) ? entries[i].count / g_profile.frames : 0
+      );
+    }
+    fclose(f);
+  }
+  free(entries);
+}
+#endif
+
 static void loop(struct gb_s * const gb) {
   struct priv_s * const priv = gb->direct.priv;
   unsigned long long current_time = 0, last_time = 0, power_event_start = 0;
@@ -1254,34 +2926,49 @@ static void loop(struct gb_s * const gb) {
   bool holding_quit_key = false, holding_mute_key = false, holding_save_key = false;
   short delay_factor_counter = 0;
   int delay_millis_sum = 0;
+  short memory_report_counter = 0;
+  short silent_audio_frames_counter = 0;
 
   bool debug_show_delay_factor = priv->config.debug_show_delay_factor;
+  bool debug_memory_report = priv->config.debug_memory_report;
+  bool debug_show_silent_audio_frames = priv->config.debug_show_silent_audio_frames;
   bool sram_auto_commit = priv->config.sram_auto_commit;
   short button_hold_compensation_num = priv->config.button_hold_compensation_num;
   short button_hold_compensation_denom = priv->config.button_hold_compensation_denom;
+  bool rtc_sleep = priv->timing.rtc_sleep;
+  unsigned short sleep_scale = priv->timing.sleep_scale;
+
+  void (*draw_line)(struct gb_s *gb, const uint8_t pixels[160], const uint_fast8_t line) = priv->lcd_draw_line;
+  if (priv->present_thread) {
+    draw_line = &lcd_capture_line;
+  } else if (priv->skip_static_lines) {
+    draw_line = &lcd_draw_line_if_changed;
+  }
 
   while (true) {
     /* Power event handling. */
-    if (power_event) {
+    if (priv->input.power_event) {
       power_event_start = mutekix_time_get_usecs();
-      power_event = false;
+      priv->input.power_event = false;
     }
     if (power_event_start != 0 && mutekix_time_get_usecs() - power_event_start >= 500000ull) {
       if (priv->config.sync_rtc_on_resume) {
         _set_rtc(gb);
       }
       power_event_start = 0;
+      _screen_invalidate(&priv->screen);
     }
 
     last_time = mutekix_time_get_ticks();
 
     /* Cache the key code values in register to avoid repeated LDRs. */
-    unsigned int emu_key_state_current = emu_key_state;
+    unsigned int emu_key_state_current = priv->input.emu_key_state;
 
     if (emu_key_state_current & EMU_KEY_QUIT) {
       if (!holding_quit_key) {
         holding_quit_key = true;
-        _input_poller_end(gb);
+        _input_poller_pause(gb);
+        _present_flush(priv);
         unsigned int ret = MessageBox(
           _BUL("Are you sure you want to quit?"),
           MB_ICON_QUESTION | MB_BUTTON_YES | MB_BUTTON_NO
@@ -1292,6 +2979,7 @@ static void loop(struct gb_s * const gb) {
         if (priv->config.sync_rtc_on_resume) {
           _set_rtc(gb);
         }
+        _screen_invalidate(&priv->screen);
         _input_poller_begin(gb);
         continue;
       }
@@ -1302,7 +2990,7 @@ static void loop(struct gb_s * const gb) {
     if (emu_key_state_current & EMU_KEY_MUTE) {
       if (!holding_mute_key) {
         if (priv->sound_on) {
-          _sound_off(gb);
+          _sound_pause(gb);
         } else {
           _sound_on(gb);
         }
@@ -1313,6 +3001,7 @@ static void loop(struct gb_s * const gb) {
     }
 
     /* Handle vertical scrolling for 240x96 screens. */
+    unsigned short yskip = priv->yskip;
     if (priv->height < LCD_HEIGHT) {
       if (emu_key_state_current & EMU_KEY_SCROLL_UP) {
         if (priv->yskip > 0) {
@@ -1330,28 +3019,76 @@ static void loop(struct gb_s * const gb) {
         priv->yskip = LCD_HEIGHT - priv->height;
       }
     }
+    if (priv->yskip != yskip) {
+      _screen_invalidate(&priv->screen);
+    }
+
+    uint8_t joypad = ~priv->input.pad_key_state;
+    bool reset = !!(emu_key_state_current & EMU_KEY_RESET);
+    if (priv->movie.mode != INPUT_MOVIE_OFF) {
+      _movie_frame(priv, &joypad, &reset);
+    }
 
-    if (emu_key_state_current & EMU_KEY_RESET) {
+    if (reset) {
       gb_reset(gb);
     }
 
-    gb->direct.joypad = ~pad_key_state;
+    gb->direct.joypad = joypad;
 
+    /* Lines below the visible window are skipped by detaching the line callback, which makes the core's
+       __gb_draw_line() return early (see _skip_lines_after()). Lines above it are still rendered. */
+    gb->display.lcd_draw_line = draw_line;
     gb_run_frame(gb);
+    PROFILE_COUNT(g_profile.frames);
     if (priv->sound_on) {
-      uint8_t pbuf = audio_buffer_producer_offset;
-      if (((pbuf + 1) & 3) != audio_buffer_consumer_offset) {
-        audio_callback_wrapper(&audio_buffer[pbuf * AUDIO_SAMPLES_TOTAL]);
-        pbuf++;
-        pbuf &= 3;
-        audio_buffer_producer_offset = pbuf;
+      struct priv_audio_s * const audio = &priv->audio;
+      uint8_t pbuf = audio->producer_offset;
+      if (((pbuf + 1) & audio->ring_mask) != audio->consumer_offset) {
+#ifndef LEGACY_APU
+        if (audio->async) {
+          /* The worker replays the log and synthesizes while the next frame is being emulated. */
+          _apu_log_submit(audio, pbuf, true);
+        } else {
+#endif
+          _audio_produce(audio, pbuf);
+          pbuf++;
+          pbuf &= audio->ring_mask;
+          audio->producer_offset = pbuf;
+#ifndef LEGACY_APU
+        }
+#endif
       }
     }
 
-    if (priv->fallback_blit && !priv->p4_1line_buffer) {
+    if (priv->present_thread) {
+      /* Hand the frame over if the worker is done with the previous one, otherwise drop it and capture the next
+         frame into the same buffer. */
+      struct priv_present_s * const present = &priv->present;
+      if (!present->pending) {
+        present->buffer = present->capture;
+        present->pending = true;
+        present->capture ^= 1;
+        memset(present->frames[present->capture].valid, 0, sizeof(present->frames[present->capture].valid));
+      }
+    } else if (priv->fallback_blit && !priv->p4_1line_buffer && (!priv->skip_static_lines || priv->screen.changed)) {
       _BitBlt(priv->real_fb, priv->canvas_x, priv->canvas_y, priv->width, priv->height, priv->fb, 0, 0, BLIT_NONE);
     }
 
+    if (priv->skip_static_lines) {
+      struct priv_screen_s * const screen = &priv->screen;
+      if (screen->changed) {
+        screen->static_frames = 0;
+      } else if (screen->static_frames < STATIC_SCREEN_FRAMES) {
+        screen->static_frames++;
+      }
+      screen->idle = (screen->static_frames >= STATIC_SCREEN_FRAMES);
+      screen->changed = false;
+      /* Don't render every line of a screen that isn't changing. The core skips drawing every other frame while
+         idle and the time saved is slept away at the end of the frame. A change shows up at most one frame late and
+         ends the idle state. */
+      gb->direct.frame_skip = priv->config.half_refresh || screen->idle;
+    }
+
     if (emu_key_state_current & EMU_KEY_SRAM_COMMIT) {
       if (!holding_save_key) {
         _write_save(gb, priv->save_file_name);
@@ -1391,8 +3128,14 @@ static void loop(struct gb_s * const gb) {
 
     short sleep_millis = frame_advance - elapsed_time;
 
-    if (holding_any_key && (button_hold_compensation_denom != 1 || button_hold_compensation_denom != 1)) {
+    if (priv->input.holding_any_key && (button_hold_compensation_denom != 1 || button_hold_compensation_denom != 1)) {
       sleep_millis -= elapsed_time * button_hold_compensation_num / button_hold_compensation_denom;
+    } else if (priv->input.holding_any_key && priv->timing.hold_scale != 0) {
+      /* The scheduler clock runs slow while a key is held, so a frame is fewer ticks long. */
+      sleep_millis = ((frame_advance * priv->timing.hold_scale) >> 8) - elapsed_time;
+    }
+    if (priv->timing.hold_probe.active) {
+      _probe_hold_stall(priv);
     }
 
     if (debug_show_delay_factor) {
@@ -1405,11 +3148,28 @@ static void loop(struct gb_s * const gb) {
       }
     }
 
+    if (debug_memory_report) {
+      memory_report_counter++;
+      if (memory_report_counter >= 32) {
+        PrintfXY(0, GetFontHeight(MONOSPACE_CJK), "%5uK%s", (unsigned int) (_memory_total(priv) >> 10), priv->low_memory ? " LOW" : "");
+        memory_report_counter = 0;
+      }
+    }
+
+    if (debug_show_silent_audio_frames) {
+      silent_audio_frames_counter++;
+      if (silent_audio_frames_counter >= 32) {
+        PrintfXY(0, GetFontHeight(MONOSPACE_CJK) * 2, "%8u", priv->audio.silent_frames);
+        silent_audio_frames_counter = 0;
+      }
+    }
+
     /* Yield from current thread so other threads (like the input poller) can be executed on-time */
-    if (mutekix_time_get_quantum() == 500) {
+    if (rtc_sleep) {
       sleep_with_double_rtc(sleep_millis > 0 ? sleep_millis : 1);
     } else {
-      OSSleep(sleep_millis > 0 ? sleep_millis : 1);
+      short os_sleep_millis = (sleep_millis * sleep_scale) >> 8;
+      OSSleep(os_sleep_millis > 0 ? os_sleep_millis : 1);
     }
   }
 }
@@ -1470,8 +3230,225 @@ static void migrate_config(void) {
   }
 }
 
+#define BENCH_PASSES_MAX 5
+
+/* Blitter used for one benchmark pass. */
+struct bench_blitter_s {
+  const char *name;
+  void (*lcd_draw_line)(struct gb_s *gb, const uint8_t pixels[160], const uint_fast8_t line);
+  /* Height of the L4 buffer the blitter draws into, or 0 if it draws to the surface directly. */
+  unsigned short buffer_height;
+};
+
+/* Timings of one benchmark pass, in microseconds. */
+struct bench_result_s {
+  unsigned long long total;
+  unsigned long long audio;
+  unsigned int worst;
+};
+
+static const struct bench_blitter_s BENCH_BLITTERS[] = {
+  {"xrgb", &lcd_draw_line_fast_xrgb, 0},
+  {"xrgb_rot", &lcd_draw_line_fast_xrgb_rot, 0},
+  {"xrgb_scaled", &lcd_draw_line_fast_xrgb_scaled, 0},
+  {"rgb565", &lcd_draw_line_fast_rgb565, 0},
+  {"rgb565_scaled", &lcd_draw_line_fast_rgb565_scaled, 0},
+  {"rgb565_sa7101", &lcd_draw_line_fast_rgb565_sa7101, 0},
+  {"p4", &lcd_draw_line_fast_p4, 1},
+  {"p4_sa7101_t1", &lcd_draw_line_fast_p4_sa7101_t1, 0},
+  {"p4_sa7101_t2", &lcd_draw_line_fast_p4_sa7101_t2, 0},
+  {"safe", &lcd_draw_line_safe, LCD_HEIGHT},
+};
+
+static const struct bench_blitter_s *_bench_find_blitter(
+  void (*lcd_draw_line)(struct gb_s *gb, const uint8_t pixels[160], const uint_fast8_t line)
+) {
+  for (size_t i = 0; i < sizeof(BENCH_BLITTERS) / sizeof(BENCH_BLITTERS[0]); i++) {
+    if (BENCH_BLITTERS[i].lcd_draw_line == lcd_draw_line) {
+      return &BENCH_BLITTERS[i];
+    }
+  }
+  return NULL;
+}
+
+static size_t _bench_add_pass(
+  const struct bench_blitter_s **passes,
+  size_t npasses,
+  const struct bench_blitter_s *blitter
+) {
+  if (blitter == NULL) {
+    return npasses;
+  }
+  for (size_t i = 0; i < npasses; i++) {
+    if (passes[i] == blitter) {
+      return npasses;
+    }
+  }
+  passes[npasses] = blitter;
+  return npasses + 1;
+}
+
+/* Switch to another blitter. Buffers are released by exit_cleanup() as usual. */
+static bool _bench_select(struct gb_s *gb, lcd_surface_t *surface, const struct bench_blitter_s *blitter) {
+  struct priv_s *priv = gb->direct.priv;
+
+  if (priv->fallback_blit) {
+    free(priv->fb);
+    priv->fb = NULL;
+    priv->fallback_blit = false;
+    priv->p4_1line_buffer = false;
+  }
+
+  if (blitter->buffer_height != 0) {
+    priv->fb = (lcd_surface_t *) calloc(GetImageSizeExt(LCD_WIDTH, blitter->buffer_height, LCD_SURFACE_PIXFMT_L4), 1);
+    if (priv->fb == NULL) {
+      return false;
+    }
+    priv->fallback_blit = true;
+    priv->p4_1line_buffer = (blitter->buffer_height == 1);
+    priv->real_fb = surface;
+    InitGraphic(priv->fb, LCD_WIDTH, blitter->buffer_height, LCD_SURFACE_PIXFMT_L4);
+    memcpy(priv->fb->palette, PALETTE_P4, sizeof(PALETTE_P4));
+  } else {
+    priv->fb = surface;
+    priv->rotation = ROTATION_TOP_SIDE_FACING_UP;
+  }
+
+  priv->lcd_draw_line = blitter->lcd_draw_line;
+  _set_blit_parameter(gb, surface);
+  _precompute_yoff(gb);
+  return true;
+}
+
+/* Run the emulator for a fixed number of frames without pacing. Audio is synthesized but not played. */
+static void _bench_run(struct gb_s *gb, unsigned int frames, audio_sample_t *samples, struct bench_result_s *result) {
+  struct priv_s * const priv = gb->direct.priv;
+
+  memset(result, 0, sizeof(*result));
+  ClearScreen(false);
+  /* Start every pass from the same state. The benchmark never saves, so cart RAM can be wiped. */
+  if (priv->cart_ram != NULL) {
+    memset(priv->cart_ram, 0, priv->cart_ram_size);
+  }
+  _audio_init(&priv->audio);
+  gb_reset(gb);
+  /* Restart the input movie so that every pass plays the same input. Recording is disabled while benchmarking. */
+  if (priv->config.debug_input_movie == INPUT_MOVIE_PLAY) {
+    _movie_end(priv);
+    _movie_begin(gb);
+  }
+
+  for (unsigned int i = 0; i < frames; i++) {
+    unsigned long long frame_start = mutekix_time_get_usecs();
+
+    uint8_t joypad = 0xff;
+    bool reset = false;
+    if (priv->movie.mode != INPUT_MOVIE_OFF) {
+      _movie_frame(priv, &joypad, &reset);
+    }
+    if (reset) {
+      gb_reset(gb);
+    }
+    gb->direct.joypad = joypad;
+
+    gb->display.lcd_draw_line = priv->lcd_draw_line;
+    gb_run_frame(gb);
+    PROFILE_COUNT(g_profile.frames);
+    if (priv->fallback_blit && !priv->p4_1line_buffer) {
+      _BitBlt(priv->real_fb, priv->canvas_x, priv->canvas_y, priv->width, priv->height, priv->fb, 0, 0, BLIT_NONE);
+    }
+
+    unsigned long long audio_start = mutekix_time_get_usecs();
+    if (samples != NULL && _apu_can_output(&priv->audio)) {
+      audio_callback_wrapper(&priv->audio, samples);
+    }
+    unsigned long long frame_end = mutekix_time_get_usecs();
+
+    unsigned int frame_time = frame_end - frame_start;
+    result->total += frame_time;
+    result->audio += frame_end - audio_start;
+    if (frame_time > result->worst) {
+      result->worst = frame_time;
+    }
+  }
+}
+
+/* Benchmark the configured blitter and every other blitter that works on this surface, and write the results to
+   BENCHMARK_PATH. */
+static void _benchmark(struct gb_s *gb, lcd_surface_t *surface) {
+  struct priv_s * const priv = gb->direct.priv;
+  const unsigned int frames = priv->config.debug_benchmark_frames;
+  const struct bench_blitter_s *passes[BENCH_PASSES_MAX];
+  struct bench_result_s results[BENCH_PASSES_MAX];
+  size_t npasses = 0;
+
+  /* The configured blitter always goes first and runs with the buffers main() set up. */
+  npasses = _bench_add_pass(passes, npasses, _bench_find_blitter(priv->lcd_draw_line));
+  if (surface->depth == LCD_SURFACE_PIXFMT_L4) {
+    npasses = _bench_add_pass(passes, npasses, _bench_find_blitter(&lcd_draw_line_fast_p4));
+    /* The SA7101 blitters write to the LCD controller directly. Only try the one the board was configured with, since
+       the other protocol would send garbage to the controller. */
+    switch (priv->config.l4_lcd_type) {
+      case 1:
+        npasses = _bench_add_pass(passes, npasses, _bench_find_blitter(&lcd_draw_line_fast_p4_sa7101_t1));
+        break;
+      case 2:
+        npasses = _bench_add_pass(passes, npasses, _bench_find_blitter(&lcd_draw_line_fast_p4_sa7101_t2));
+        break;
+    }
+  }
+  npasses = _bench_add_pass(passes, npasses, _bench_find_blitter(&lcd_draw_line_safe));
+
+  audio_sample_t *audio = NULL;
+  if (priv->config.enable_audio) {
+    audio = calloc(AUDIO_SAMPLES_TOTAL, sizeof(*audio));
+  }
+
+  size_t completed = 0;
+  for (; completed < npasses; completed++) {
+    if (passes[completed]->lcd_draw_line != priv->lcd_draw_line && !_bench_select(gb, surface, passes[completed])) {
+      break;
+    }
+    _bench_run(gb, frames, audio, &results[completed]);
+  }
+  free(audio);
+
+  FILE *f = fopen(BENCHMARK_PATH, "w");
+  if (f == NULL) {
+    MessageBox(_BUL("Cannot write benchmark results."), MB_BUTTON_OK | MB_ICON_ERROR);
+    return;
+  }
+  fprintf(f, "Frames: %u\r\n", frames);
+  fprintf(f, "Surface depth: %d\r\n", surface->depth);
+  for (size_t i = 0; i < completed; i++) {
+    if (results[i].total == 0) {
+      continue;
+    }
+    unsigned int fps_x100 = frames * 100000000ull / results[i].total;
+    fprintf(
+      f,
+      "%s: %u.%02u fps, avg %u us, worst %u us, audio %u us\r\n",
+      passes[i]->name,
+      fps_x100 / 100,
+      fps_x100 % 100,
+      (unsigned int) (results[i].total / frames),
+      results[i].worst,
+      (unsigned int) (results[i].audio / frames)
+    );
+  }
+  fclose(f);
+
+  messagebox_format(MB_DEFAULT, "Benchmark results written to %s", BENCHMARK_PATH);
+}
+
 static void _load_config(struct priv_s *priv) {
   priv->config.enable_audio = !!_GetPrivateProfileInt("Config", "EnableAudio", 1, CONFIG_PATH);
+  priv->config.async_audio = !!_GetPrivateProfileInt("Config", "AsyncAudio", 0, CONFIG_PATH);
+  priv->config.present_thread = !!_GetPrivateProfileInt("Config", "PresentThread", 0, CONFIG_PATH);
+  priv->config.static_screen_idle = !!_GetPrivateProfileInt("Config", "StaticScreenIdle", 0, CONFIG_PATH);
+  priv->config.auto_timing = !!_GetPrivateProfileInt("Config", "AutoTiming", 0, CONFIG_PATH);
+  priv->config.live_joypad = !!_GetPrivateProfileInt("Config", "LiveJoypad", 0, CONFIG_PATH);
+  priv->config.fit_height = !!_GetPrivateProfileInt("Config", "FitHeight", 0, CONFIG_PATH);
   priv->config.interlace = !!_GetPrivateProfileInt("Config", "Interlace", 0, CONFIG_PATH);
   priv->config.half_refresh = !!_GetPrivateProfileInt("Config", "HalfRefresh", 0, CONFIG_PATH);
   priv->config.sram_auto_commit = !!_GetPrivateProfileInt("Config", "SRAMAutoCommit", 1, CONFIG_PATH);
@@ -1481,8 +3458,18 @@ static void _load_config(struct priv_s *priv) {
   priv->config.sync_rtc_on_resume = !!_GetPrivateProfileInt("Config", "SyncRTCOnResume", 0, CONFIG_PATH);
   priv->config.l4_lcd_type = !!_GetPrivateProfileInt("Config", "L4LCDType", 0, CONFIG_PATH);
   priv->config.use_boot_rom = !!_GetPrivateProfileInt("Config", "UseBootROM", 1, CONFIG_PATH);
+  priv->config.low_memory_mode = !!_GetPrivateProfileInt("Config", "LowMemoryMode", 0, CONFIG_PATH);
   priv->config.debug_show_delay_factor = !!_GetPrivateProfileInt("Debug", "ShowDelayFactor", 0, CONFIG_PATH);
   priv->config.debug_force_safe_framebuffer = !!_GetPrivateProfileInt("Debug", "ForceSafeFramebuffer", 0, CONFIG_PATH);
+  priv->config.debug_memory_report = !!_GetPrivateProfileInt("Debug", "MemoryReport", 0, CONFIG_PATH);
+  priv->config.debug_show_silent_audio_frames = !!_GetPrivateProfileInt("Debug", "ShowSilentAudioFrames", 0, CONFIG_PATH);
+  priv->config.debug_input_movie = _GetPrivateProfileInt("Debug", "InputMovie", INPUT_MOVIE_OFF, CONFIG_PATH);
+  priv->config.debug_benchmark_frames = _GetPrivateProfileInt("Debug", "Benchmark", 0, CONFIG_PATH);
+  /* The benchmark feeds its own input and would overwrite the recording. */
+  if (priv->config.debug_benchmark_frames != 0 && priv->config.debug_input_movie == INPUT_MOVIE_RECORD) {
+    priv->config.debug_input_movie = INPUT_MOVIE_OFF;
+  }
+  priv->config.scale = _GetPrivateProfileInt("Config", "Scale", SCALE_MODE_OFF, CONFIG_PATH);
 
   /* Filter out illegal values that may cause bad behavior. */
   if (priv->config.button_hold_compensation_num == 0) {
@@ -1491,28 +3478,31 @@ static void _load_config(struct priv_s *priv) {
   if (priv->config.button_hold_compensation_denom == 0) {
     priv->config.button_hold_compensation_denom = 1;
   }
+  if ((unsigned int) priv->config.scale > SCALE_MODE_FIT) {
+    priv->config.scale = SCALE_MODE_OFF;
+  }
 }
 
-static void _load_key_binding(void) {
-  g_key_binding.a = _GetPrivateProfileInt("KeyBinding", "A", KEY_X, CONFIG_PATH);
-  g_key_binding.b = _GetPrivateProfileInt("KeyBinding", "B", KEY_Z, CONFIG_PATH);
-  g_key_binding.select = _GetPrivateProfileInt("KeyBinding", "Select", KEY_A, CONFIG_PATH);
-  g_key_binding.start = _GetPrivateProfileInt("KeyBinding", "Start", KEY_S, CONFIG_PATH);
-  g_key_binding.right = _GetPrivateProfileInt("KeyBinding", "Right", KEY_RIGHT, CONFIG_PATH);
-  g_key_binding.left = _GetPrivateProfileInt("KeyBinding", "Left", KEY_LEFT, CONFIG_PATH);
-  g_key_binding.up = _GetPrivateProfileInt("KeyBinding", "Up", KEY_UP, CONFIG_PATH);
-  g_key_binding.down = _GetPrivateProfileInt("KeyBinding", "Down", KEY_DOWN, CONFIG_PATH);
-  g_key_binding.reset_combo = _GetPrivateProfileInt("KeyBinding", "ResetCombo", KEY_R, CONFIG_PATH);
-
-  g_key_binding.quit = _GetPrivateProfileInt("KeyBinding", "Quit", KEY_ESC, CONFIG_PATH);
-  g_key_binding.mute = _GetPrivateProfileInt("KeyBinding", "Mute", KEY_M, CONFIG_PATH);
-  g_key_binding.reset_hard = _GetPrivateProfileInt("KeyBinding", "ResetHard", KEY_H, CONFIG_PATH);
-  g_key_binding.scroll_up = _GetPrivateProfileInt("KeyBinding", "ScrollUp", KEY_PGUP, CONFIG_PATH);
-  g_key_binding.scroll_down = _GetPrivateProfileInt("KeyBinding", "ScrollDown", KEY_PGDN, CONFIG_PATH);
-  g_key_binding.scroll_top = _GetPrivateProfileInt("KeyBinding", "ScrollTop", KEY_1, CONFIG_PATH);
-  g_key_binding.scroll_center = _GetPrivateProfileInt("KeyBinding", "ScrollCenter", KEY_2, CONFIG_PATH);
-  g_key_binding.scroll_bottom = _GetPrivateProfileInt("KeyBinding", "ScrollBottom", KEY_3, CONFIG_PATH);
-  g_key_binding.sram_commit = _GetPrivateProfileInt("KeyBinding", "SRAMCommit", KEY_SAVE, CONFIG_PATH);
+static void _load_key_binding(struct priv_s *priv) {
+  priv->key_binding.a = _GetPrivateProfileInt("KeyBinding", "A", KEY_X, CONFIG_PATH);
+  priv->key_binding.b = _GetPrivateProfileInt("KeyBinding", "B", KEY_Z, CONFIG_PATH);
+  priv->key_binding.select = _GetPrivateProfileInt("KeyBinding", "Select", KEY_A, CONFIG_PATH);
+  priv->key_binding.start = _GetPrivateProfileInt("KeyBinding", "Start", KEY_S, CONFIG_PATH);
+  priv->key_binding.right = _GetPrivateProfileInt("KeyBinding", "Right", KEY_RIGHT, CONFIG_PATH);
+  priv->key_binding.left = _GetPrivateProfileInt("KeyBinding", "Left", KEY_LEFT, CONFIG_PATH);
+  priv->key_binding.up = _GetPrivateProfileInt("KeyBinding", "Up", KEY_UP, CONFIG_PATH);
+  priv->key_binding.down = _GetPrivateProfileInt("KeyBinding", "Down", KEY_DOWN, CONFIG_PATH);
+  priv->key_binding.reset_combo = _GetPrivateProfileInt("KeyBinding", "ResetCombo", KEY_R, CONFIG_PATH);
+
+  priv->key_binding.quit = _GetPrivateProfileInt("KeyBinding", "Quit", KEY_ESC, CONFIG_PATH);
+  priv->key_binding.mute = _GetPrivateProfileInt("KeyBinding", "Mute", KEY_M, CONFIG_PATH);
+  priv->key_binding.reset_hard = _GetPrivateProfileInt("KeyBinding", "ResetHard", KEY_H, CONFIG_PATH);
+  priv->key_binding.scroll_up = _GetPrivateProfileInt("KeyBinding", "ScrollUp", KEY_PGUP, CONFIG_PATH);
+  priv->key_binding.scroll_down = _GetPrivateProfileInt("KeyBinding", "ScrollDown", KEY_PGDN, CONFIG_PATH);
+  priv->key_binding.scroll_top = _GetPrivateProfileInt("KeyBinding", "ScrollTop", KEY_1, CONFIG_PATH);
+  priv->key_binding.scroll_center = _GetPrivateProfileInt("KeyBinding", "ScrollCenter", KEY_2, CONFIG_PATH);
+  priv->key_binding.scroll_bottom = _GetPrivateProfileInt("KeyBinding", "ScrollBottom", KEY_3, CONFIG_PATH);
+  priv->key_binding.sram_commit = _GetPrivateProfileInt("KeyBinding", "SRAMCommit", KEY_SAVE, CONFIG_PATH);
 }
 
 int main(void) {
@@ -1521,13 +3511,19 @@ int main(void) {
 
   migrate_config();
   _load_config(&priv);
-  _load_key_binding();
+  _load_key_binding(&priv);
 
   int file_picker_result = rom_file_picker(&priv);
   if (file_picker_result > 0) {
     return file_picker_result - 1;
   }
 
+  /* Catch obviously unloadable ROMs before reading the whole file. */
+  int precheck_result = rom_precheck(&priv);
+  if (precheck_result > 0) {
+    return precheck_result - 1;
+  }
+
   /* Setup emulator states. */
   lcd_t *lcd = GetActiveLCD();
   if (lcd == NULL || lcd->surface == NULL) {
@@ -1547,7 +3543,9 @@ int main(void) {
     PRINT_NONE
   );
 
-  priv.rom = _read_file(priv.rom_file_name, 0, false);
+  priv.low_memory = priv.config.low_memory_mode;
+
+  priv.rom = _read_file(priv.rom_file_name, 0, false, &priv.mem.rom);
   if (priv.rom == NULL) {
     return 1;
   }
@@ -1575,26 +3573,44 @@ int main(void) {
   }
   }
 
+  /* The boot ROM is purely cosmetic, so don't spend memory on it in low memory mode. */
+  if (priv.config.use_boot_rom && !priv.low_memory) {
 #if PEANUT_FULL_GBC_SUPPORT
-  priv.boot_rom = _read_file(gb.cgb.cgbMode ? BOOT_ROM_CGB_PATH : BOOT_ROM_PATH, 0, false);
+    priv.boot_rom = _read_file(gb.cgb.cgbMode ? BOOT_ROM_CGB_PATH : BOOT_ROM_PATH, 0, false, &priv.mem.boot_rom);
 #else
-  priv.boot_rom = _read_file(BOOT_ROM_PATH, 0, false);
+    priv.boot_rom = _read_file(BOOT_ROM_PATH, 0, false, &priv.mem.boot_rom);
 #endif
-  if (priv.config.use_boot_rom && priv.boot_rom != NULL) {
+  }
+  if (priv.boot_rom != NULL) {
     gb_set_bootrom(&gb, &gb_bootrom_read);
     gb_reset(&gb);
   }
 
   _set_rtc(&gb);
-  audio_init();
+  if (!_movie_begin(&gb)) {
+    messagebox_format(
+      MB_BUTTON_OK | MB_ICON_WARNING,
+      "Cannot open input movie %s. Continuing with live input.",
+      priv.movie_file_name
+    );
+  }
+  _audio_init(&priv.audio);
 
   if (gb_get_save_size_s(&gb, &priv.cart_ram_size) < 0) {
     MessageBox(_BUL("Unable to get save size."), MB_BUTTON_OK | MB_ICON_ERROR);
     exit_cleanup(&gb);
     return 1;
   }
-  if (priv.cart_ram_size != 0) {
-    priv.cart_ram = _read_file(priv.save_file_name, priv.cart_ram_size, true);
+  if (priv.cart_ram_size != 0 && priv.movie.mode != INPUT_MOVIE_OFF) {
+    priv.cart_ram = calloc(priv.cart_ram_size, 1);
+    priv.mem.cart_ram = priv.cart_ram_size;
+    if (priv.cart_ram == NULL) {
+      MessageBox(_BUL("Cannot allocate memory for save data."), MB_BUTTON_OK | MB_ICON_ERROR);
+      exit_cleanup(&gb);
+      return 1;
+    }
+  } else if (priv.cart_ram_size != 0) {
+    priv.cart_ram = _read_file(priv.save_file_name, priv.cart_ram_size, true, &priv.mem.cart_ram);
     if (priv.cart_ram == NULL) {
       MessageBox(
         _BUL("Save data is available but the emulator is unable to load it."),
@@ -1605,61 +3621,79 @@ int main(void) {
     }
   }
 
-  if (lcd->surface->depth == LCD_SURFACE_PIXFMT_XRGB && !priv.config.debug_force_safe_framebuffer) {
+  bool fast_blit = !priv.config.debug_force_safe_framebuffer;
+  bool is_sa7101 = ((uintptr_t) lcd->surface->buffer) == ((uintptr_t) SA7101_LCD_DATA);
+
 #if PEANUT_FULL_GBC_SUPPORT
-    if (gb.cgb.cgbMode) {
-      color_map_cgb_32 = generate_cgb_table_xrgb();
-      if (color_map_cgb_32 == NULL) {
-        MessageBox(
-          _BUL("Cannot allocate memory for fast CGB color table."),
-          MB_BUTTON_OK | MB_ICON_ERROR
-        );
-        exit_cleanup(&gb);
-        return 1;
+  /* The fast RGB blitters need a full 15-bit color table in CGB mode. Without one, degrade to the line-buffered
+     grayscale blitter. */
+  if (fast_blit && gb.cgb.cgbMode) {
+    if (lcd->surface->depth == LCD_SURFACE_PIXFMT_XRGB) {
+      if (!priv.low_memory) {
+        priv.color_map_cgb_32 = generate_cgb_table_xrgb();
+      }
+      if (priv.color_map_cgb_32 == NULL) {
+        priv.low_memory = true;
+        fast_blit = false;
+      } else {
+        priv.mem.cgb_table = 32 * 32 * 32 * sizeof(*priv.color_map_cgb_32);
+      }
+    } else if (lcd->surface->depth == LCD_SURFACE_PIXFMT_RGB565) {
+      if (!priv.low_memory) {
+        priv.color_map_cgb_16 = is_sa7101 ? generate_cgb_table_bgr565() : generate_cgb_table_rgb565();
+      }
+      if (priv.color_map_cgb_16 == NULL) {
+        priv.low_memory = true;
+        fast_blit = false;
+      } else {
+        priv.mem.cgb_table = 32 * 32 * 32 * sizeof(*priv.color_map_cgb_16);
       }
     }
+  }
 #endif
+
+  if (lcd->surface->depth == LCD_SURFACE_PIXFMT_XRGB && fast_blit) {
     priv.fb = lcd->surface;
     priv.rotation = lcd->rotation;
     /* Only use the rotation-aware blit when absolutely needed. Saves about 1-2ms on BA802. */
     if (lcd->rotation != ROTATION_TOP_SIDE_FACING_UP) {
       gb_init_lcd(&gb, &lcd_draw_line_fast_xrgb_rot);
+    } else if (priv.config.scale != SCALE_MODE_OFF) {
+      gb_init_lcd(&gb, &lcd_draw_line_fast_xrgb_scaled);
     } else {
       gb_init_lcd(&gb, &lcd_draw_line_fast_xrgb);
     }
-  } else if (lcd->surface->depth == LCD_SURFACE_PIXFMT_RGB565 && !priv.config.debug_force_safe_framebuffer) {
-    bool is_sa7101 = ((uintptr_t) lcd->surface->buffer) == ((uintptr_t) SA7101_LCD_DATA);
-#if PEANUT_FULL_GBC_SUPPORT
-    if (gb.cgb.cgbMode) {
-      color_map_cgb_16 = is_sa7101 ? generate_cgb_table_bgr565() : generate_cgb_table_rgb565();
-      if (color_map_cgb_16 == NULL) {
-        MessageBox(
-          _BUL("Cannot allocate memory for fast CGB color table."),
-          MB_BUTTON_OK | MB_ICON_ERROR
-        );
-        exit_cleanup(&gb);
-        return 1;
-      }
-    }
-#endif
+  } else if (lcd->surface->depth == LCD_SURFACE_PIXFMT_RGB565 && fast_blit) {
     priv.fb = lcd->surface;
     priv.rotation = ROTATION_TOP_SIDE_FACING_UP;
     if (is_sa7101) {
       gb_init_lcd(&gb, &lcd_draw_line_fast_rgb565_sa7101);
+    } else if (priv.config.scale != SCALE_MODE_OFF) {
+      gb_init_lcd(&gb, &lcd_draw_line_fast_rgb565_scaled);
     } else {
       gb_init_lcd(&gb, &lcd_draw_line_fast_rgb565);
     }
-  } else if (lcd->surface->depth == LCD_SURFACE_PIXFMT_L4 && priv.config.l4_lcd_type == 0 && !priv.config.debug_force_safe_framebuffer) {
+  } else if (
+      (lcd->surface->depth == LCD_SURFACE_PIXFMT_L4 && priv.config.l4_lcd_type == 0 && fast_blit) ||
+      (priv.low_memory && lcd->surface->depth != LCD_SURFACE_PIXFMT_L4 && !priv.config.debug_force_safe_framebuffer)
+  ) {
     /* 4-bit LCD machines don't have a hardware-backed framebuffer and
-     * we need to blit a 160x1 buffer to the screen line-by-line. */
+     * we need to blit a 160x1 buffer to the screen line-by-line.
+     * This is also the low memory fallback for all other surfaces. */
     priv.fallback_blit = true;
     priv.p4_1line_buffer = true;
-    priv.fb = (lcd_surface_t *) calloc(GetImageSizeExt(LCD_WIDTH, 1, LCD_SURFACE_PIXFMT_L4), 1);
+    priv.mem.framebuffer = GetImageSizeExt(LCD_WIDTH, 1, LCD_SURFACE_PIXFMT_L4);
+    priv.fb = (lcd_surface_t *) calloc(priv.mem.framebuffer, 1);
+    if (priv.fb == NULL) {
+      MessageBox(_BUL("Cannot allocate memory for framebuffer."), MB_BUTTON_OK | MB_ICON_ERROR);
+      exit_cleanup(&gb);
+      return 1;
+    }
     priv.real_fb = lcd->surface;
     InitGraphic(priv.fb, LCD_WIDTH, 1, LCD_SURFACE_PIXFMT_L4);
     memcpy(priv.fb->palette, PALETTE_P4, sizeof(PALETTE_P4));
     gb_init_lcd(&gb, &lcd_draw_line_fast_p4);
-  } else if (lcd->surface->depth == LCD_SURFACE_PIXFMT_L4 && !priv.config.debug_force_safe_framebuffer) {
+  } else if (lcd->surface->depth == LCD_SURFACE_PIXFMT_L4 && fast_blit) {
     /* 4-bit LCD machines don't have a hardware-backed framebuffer and
      * we need to blit a 160x1 buffer to the screen line-by-line. */
     priv.fb = lcd->surface;
@@ -1687,13 +3721,20 @@ int main(void) {
       );
     }
     priv.fallback_blit = true;
-    priv.fb = (lcd_surface_t *) calloc(GetImageSizeExt(LCD_WIDTH, LCD_HEIGHT, LCD_SURFACE_PIXFMT_L4), 1);
+    priv.mem.framebuffer = GetImageSizeExt(LCD_WIDTH, LCD_HEIGHT, LCD_SURFACE_PIXFMT_L4);
+    priv.fb = (lcd_surface_t *) calloc(priv.mem.framebuffer, 1);
+    if (priv.fb == NULL) {
+      MessageBox(_BUL("Cannot allocate memory for framebuffer."), MB_BUTTON_OK | MB_ICON_ERROR);
+      exit_cleanup(&gb);
+      return 1;
+    }
     priv.real_fb = lcd->surface;
     InitGraphic(priv.fb, LCD_WIDTH, LCD_HEIGHT, LCD_SURFACE_PIXFMT_L4);
     memcpy(priv.fb->palette, PALETTE_P4, sizeof(PALETTE_P4));
     gb_init_lcd(&gb, &lcd_draw_line_safe);
   }
 
+  priv.lcd_draw_line = gb.display.lcd_draw_line;
   _set_blit_parameter(&gb, lcd->surface);
   _precompute_yoff(&gb);
 
@@ -1701,6 +3742,18 @@ int main(void) {
   gb.direct.interlace = priv.config.interlace;
   gb.direct.frame_skip = priv.config.half_refresh;
 
+  if (priv.config.debug_benchmark_frames != 0) {
+    mutekix_time_init();
+    _benchmark(&gb, lcd->surface);
+    mutekix_time_fini();
+#if WB_PROFILE
+    _write_profile_report();
+#endif
+    _movie_end(&priv);
+    exit_cleanup(&gb);
+    return 0;
+  }
+
   if (priv.config.enable_audio) {
     _sound_on(&gb);
   }
@@ -1708,11 +3761,38 @@ int main(void) {
   // Clear the framebuffer so our non-DMA BLIT functions won't leave garbage behind.
   ClearScreen(false);
 
+  _calibrate_timing(&gb, lcd);
+  _present_begin(&gb);
+  /* Fit-to-height blends groups of 3 lines, so every line of a group has to reach the blitter. */
+  priv.skip_static_lines = priv.config.static_screen_idle && !priv.present_thread && !priv.fit_height;
+  /* CGB lines hold palette indices, so a palette change would not show up in the line comparison. */
+#if PEANUT_FULL_GBC_SUPPORT
+  priv.skip_static_lines = priv.skip_static_lines && !gb.cgb.cgbMode;
+#endif
+  if (priv.skip_static_lines) {
+    priv.screen.lines = calloc(LCD_HEIGHT, sizeof(*priv.screen.lines));
+    if (priv.screen.lines != NULL) {
+      priv.mem.framebuffer += LCD_HEIGHT * sizeof(*priv.screen.lines);
+    } else {
+      priv.skip_static_lines = false;
+    }
+  }
+  _screen_invalidate(&priv.screen);
+  /* Input movies record and replay the joypad once per frame. */
+  priv.live_joypad = priv.config.live_joypad && priv.movie.mode == INPUT_MOVIE_OFF;
   _input_poller_begin(&gb);
+  if (priv.config.debug_memory_report) {
+    _write_memory_report(&gb);
+  }
   loop(&gb);
   _input_poller_end(&gb);
+  _present_end(&gb);
+#if WB_PROFILE
+  _write_profile_report();
+#endif
 
   _write_save(&gb, priv.save_file_name);
+  _movie_end(&priv);
 
   mutekix_time_fini();
   _sound_off(&gb);
@@ -1743,10 +3823,19 @@ static void exit_cleanup(const struct gb_s * const gb) {
     priv->fb = NULL;
   }
 
+  if (priv->screen.lines != NULL) {
+    free(priv->screen.lines);
+    priv->screen.lines = NULL;
+  }
+
 #if PEANUT_FULL_GBC_SUPPORT
-  if (color_map_cgb_32 != NULL) {
-    free(color_map_cgb_32);
-    color_map_cgb_32 = NULL;
+  if (priv->color_map_cgb_16 != NULL) {
+    free(priv->color_map_cgb_16);
+    priv->color_map_cgb_16 = NULL;
+  }
+  if (priv->color_map_cgb_32 != NULL) {
+    free(priv->color_map_cgb_32);
+    priv->color_map_cgb_32 = NULL;
   }
 #endif
 }